@@ -9,14 +9,29 @@
 #include <Python.h> // non-standard
 
 #include <Magick++.h> // non-standard
+#include <algorithm>
 #include <any>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <climits>
 #include <cmath>
 #include <concepts>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <exception>
+#include <fcntl.h> // non-standard
 #include <filesystem>
+#include <format>
+#include <fstream>
 #include <hyx/circular_buffer.h> // non-standard
 #include <hyx/filesystem.h>      // non-standard
 #include <hyx/leptonica.h>       // non-standard
@@ -27,17 +42,33 @@
 #include <iostream>
 #include <leptonica/allheaders.h> // non-standard
 #include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <numbers>
+#include <optional>
+#include <poll.h> // non-standard
 #include <ranges>
 #include <regex>
 #include <sane/sane.h>     // non-standard
 #include <sane/saneopts.h> // non-standard
+#include <sched.h>           // non-standard
+#include <set>
+#include <span>
 #include <string>
-#include <tesseract/baseapi.h>  // non-standard
-#include <tesseract/renderer.h> // non-standard
+#include <sys/file.h>     // non-standard
+#include <sys/mman.h>     // non-standard
+#include <sys/resource.h> // non-standard
+#include <sys/syscall.h>  // non-standard
+#include <tesseract/baseapi.h>        // non-standard
+#include <tesseract/renderer.h>       // non-standard
+#include <tesseract/resultiterator.h> // non-standard
 #include <thread>
+#include <tuple>
+#include <unistd.h> // non-standard
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 //! TODO: allow for other image formats if libtiff is not available
@@ -46,9 +77,62 @@
 #include <tiffio.hxx> // non-standard
 #endif                // !HAVE_LIBTIFF
 
+#ifdef HAVE_ZBAR
+#include <zbar.h> // non-standard
+#endif            // !HAVE_ZBAR
+
+#ifdef HAVE_ZSTD
+#include <zstd.h> // non-standard
+#endif            // !HAVE_ZSTD
+
+#ifdef HAVE_LIBURING
+#include <liburing.h> // non-standard
+#endif                // !HAVE_LIBURING
+
+// static tracepoints (usdt:scan2pdf:scan2pdf:<name> in bpftrace) that are a nop unless something is attached
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h> // non-standard
+#define SCAN2PDF_PROBE(...) STAP_PROBEV(scan2pdf, __VA_ARGS__)
+#else
+#define SCAN2PDF_PROBE(...) static_cast<void>(0)
+#endif // !HAVE_SYS_SDT_H
+
 namespace global {
     constexpr std::string_view version{"2.4"};
     constexpr auto scanner_gamma_fix{2.2};
+    constexpr std::size_t threshold_band_height{256};
+    constexpr std::string_view raw_archive_magic{"S2PRAW02"};
+    // archives from before the header had flags; their scan source is unknown
+    constexpr std::string_view raw_archive_magic_v1{"S2PRAW01"};
+    constexpr std::uint64_t raw_archive_duplex{1};
+    constexpr auto raw_archive_zstd_level{3};
+    constexpr std::string_view index_magic{"S2PIDX01"};
+    constexpr std::size_t index_merge_segments{8};
+    // segments up to this size are all in the lowest merge tier; each tier above holds index_merge_segments times more
+    constexpr std::uintmax_t index_tier_floor{64 * 1024};
+    constexpr std::string_view fingerprint_store{".scan2pdf_fingerprints"};
+    constexpr std::size_t duplicate_page_distance{12};
+    // minhash values kept of a document's first page, and the share of them a rescan has to match
+    constexpr std::size_t text_signature_size{128};
+    constexpr auto known_text_similarity{0.6};
+    // not part of SANE 1; backends that can send compressed frames use this
+    constexpr auto sane_frame_jpeg{static_cast<SANE_Frame>(11)};
+    constexpr SANE_Int jpeg_proxy_resolution{150};
+    constexpr SANE_Int preview_resolution{75};
+    constexpr SANE_Int text_resolution{200};
+    constexpr std::size_t output_jpeg_quality{85};
+    constexpr std::size_t event_queue_limit{1024};
+    // how long a reader that stopped reading may hold up the end of a job
+    constexpr std::chrono::milliseconds event_flush_timeout{1000};
+    constexpr auto bulk_nice{10};
+    // share of a back side's edges left out of its blank check (for the edge shadow)
+    constexpr auto blank_back_margin{0.01};
+    // how far a back side's own deskew angle (degrees) and edges (share of the frame) may be off from the front's
+    constexpr auto back_side_angle_tolerance{0.5};
+    constexpr auto back_side_edge_tolerance{0.01};
+    constexpr unsigned async_write_depth{32};
+    // the finished pdf is copied to the output path in pieces of this size, each written while the next one is read
+    constexpr std::size_t output_copy_chunk{std::size_t{4} << 20};
 } // namespace global
 
 hyx::logger logger(std::clog, "[cl::utc;%FT%TZ][[[::lvl;^9]]]: [sl::file_name;]@[sl::line;]: ");
@@ -57,6 +141,7 @@ hyx::logger logger(std::clog, "[cl::utc;%FT%TZ][[[::lvl;^9]]]: [sl::file_name;]@
 
 constexpr double percent_to_quantum(std::convertible_to<double> auto percent);
 constexpr double quantum_to_percent(std::convertible_to<double> auto quantum);
+constexpr double luma_to_quantum(std::convertible_to<double> auto luma);
 constexpr long double quantum_as_rgb(long double quantum_val);
 
 consteval double operator""_quantum_percent(long double percent)
@@ -71,29 +156,457 @@ consteval double operator"" _quantum_percent(unsigned long long percent)
 std::string get_current_date();
 std::string parse_organization(const std::string& text, const std::string& default_return);
 
-Magick::Image get_next_image(hyx::sane_device* device);
+/**
+ * @brief An 8-bit single channel image.
+ */
+struct luma_image {
+    std::size_t width{};
+    std::size_t height{};
+    std::vector<std::uint8_t> pixels;
+};
+
+/**
+ * @brief Pixel counts of each 8-bit luminance value.
+ */
+struct luma_histogram {
+    std::array<std::size_t, 256> counts{};
+    std::size_t total{};
+};
+
+/**
+ * @brief Difference hash of a page (one bit per neighbouring cell pair of a 17x16 grid).
+ */
+using page_hash = std::bitset<256>;
+
+/**
+ * @brief Settings from the config file.
+ */
+struct scan2pdf_config {
+    // page classification thresholds (see --calibrate)
+    double white_percent{0.99};
+    double bw_mean{12.0};
+    double bw_stddev{18.0};
+    double bw_stddev_mean_diff{-0.6};
+    double grayscale_mean{5.0};
+    double grayscale_maxima{10.0};
+
+    // output resolution of each page class (0 keeps the scan resolution)
+    double grayscale_dpi{300.0};
+    double color_dpi{200.0};
+
+    // tesseract language(s), e.g., eng+deu
+    std::string language{"eng"};
+};
+
+struct gray_stats {
+    double mean{};
+    double stddev{};
+};
+
+struct saturation_stats {
+    double mean{};
+    double maxima{};
+};
+
+enum class page_class {
+    white,
+    bw,
+    grayscale,
+    color
+};
+
+/**
+ * @brief Everything the page classification looks at.
+ */
+struct page_features {
+    double percent_white{};
+    gray_stats gray;
+    saturation_stats saturation;
+};
+
+/**
+ * @brief How proccess() straightened and cropped a page.
+ */
+struct page_geometry {
+    std::size_t columns{};
+    std::size_t rows{};
+    double deskew_angle{};
+    std::size_t deskewed_columns{};
+    std::size_t deskewed_rows{};
+    Magick::Geometry trim_edges;
+};
+
+/**
+ * @brief Filename fields that are known without parsing the document text.
+ */
+struct document_fields {
+    std::optional<std::string> organization;
+    std::optional<std::string> date;
+    std::optional<std::string> store;
+    std::optional<std::string> transaction;
+};
+
+enum class threshold_method {
+    sauvola,
+    wolf
+};
+
+/**
+ * @brief A frame exactly as the scanner delivered it.
+ */
+struct raw_frame {
+    SANE_Parameters params{};
+    SANE_Int resolution{};
+    std::vector<SANE_Byte> data;
+};
+
+enum class raw_archive_compression : std::int32_t {
+    none,
+    zstd
+};
+
+/**
+ * @brief Index entry of a frame in a raw archive (see raw_archive_writer).
+ */
+struct raw_archive_entry {
+    std::uint64_t offset{};
+    std::uint64_t stored_size{};
+    std::uint64_t raw_size{};
+    std::int32_t compression{};
+    std::int32_t format{};
+    std::int32_t last_frame{};
+    std::int32_t bytes_per_line{};
+    std::int32_t pixels_per_line{};
+    std::int32_t lines{};
+    std::int32_t depth{};
+    std::int32_t resolution{};
+};
+static_assert(sizeof(raw_archive_entry) == 56, "raw archive entries are written as-is");
+
+/**
+ * @brief Writes that the calling thread does not wait on (through io_uring if it is available, else a thread of its own).
+ * The data is owned until it is written and wait() reports the first write that failed.
+ */
+class async_writer {
+public:
+    async_writer();
+    ~async_writer();
+
+    async_writer(const async_writer&) = delete;
+    async_writer& operator=(const async_writer&) = delete;
+
+    // the file is created (or truncated) right away and closed by wait()
+    int open(const std::filesystem::path& path);
+    void write(int fd, std::vector<std::uint8_t> data, std::uint64_t offset);
+    void write(const std::filesystem::path& path, std::vector<std::uint8_t> data);
+    // queued writes go to the kernel in one batch
+    void submit();
+    void wait();
+
+private:
+    struct pending_write {
+        int fd{-1};
+        std::vector<std::uint8_t> data;
+        std::uint64_t offset{};
+        std::size_t written{};
+    };
+
+    void fail(const std::string& error);
+#ifdef HAVE_LIBURING
+    void queue_ring_write(pending_write& pending);
+    void reap_ring(bool wait_for_all);
+
+    std::optional<io_uring> m_ring;
+    // the ring refers to these, so they need stable addresses
+    std::list<pending_write> m_writes;
+    std::size_t m_in_flight{};
+#endif // HAVE_LIBURING
+    void write_queued(std::stop_token stop);
+
+    std::vector<int> m_owned_fds;
+    std::vector<pending_write> m_batch;
+    std::mutex m_mutex;
+    std::condition_variable_any m_changed;
+    std::deque<pending_write> m_queue;
+    bool m_busy{};
+    std::string m_error;
+    // last, so the writer stops (and finishes its queue) before the rest is gone
+    std::jthread m_worker;
+};
+
+/**
+ * @brief Appends frames to a raw archive.
+ * Layout: magic, flags (e.g., duplex), one (zstd) blob per frame, index of raw_archive_entry, page count, index offset, magic.
+ * The index is written when the archive is closed.
+ */
+class raw_archive_writer {
+public:
+    raw_archive_writer(const std::filesystem::path& path, bool duplex);
+    ~raw_archive_writer();
+
+    raw_archive_writer(const raw_archive_writer&) = delete;
+    raw_archive_writer& operator=(const raw_archive_writer&) = delete;
+
+    void append(const raw_frame& frame);
+
+private:
+    int m_fd;
+    std::uint64_t m_size{};
+    std::vector<raw_archive_entry> m_index;
+    // the scanning thread only hands frames over, so a slow disk never holds up the scanner
+    async_writer m_writer;
+};
+
+/**
+ * @brief Random access to the frames of a raw archive.
+ * The archive is memory mapped, so only the frames that get asked for are ever read and decompressed.
+ */
+class raw_archive_reader {
+public:
+    explicit raw_archive_reader(const std::filesystem::path& path);
+    ~raw_archive_reader();
+
+    raw_archive_reader(const raw_archive_reader&) = delete;
+    raw_archive_reader& operator=(const raw_archive_reader&) = delete;
+
+    std::size_t size() const;
+    bool duplex() const;
+    raw_frame frame(std::size_t page) const;
+
+private:
+    const std::uint8_t* m_data{};
+    std::size_t m_size{};
+    std::span<const raw_archive_entry> m_index;
+    bool m_duplex{};
+};
+
+/**
+ * @brief Progress events, as json lines, written to a file descriptor by a thread of their own.
+ */
+class event_stream {
+public:
+    explicit event_stream(int fd);
+
+    event_stream(const event_stream&) = delete;
+    event_stream& operator=(const event_stream&) = delete;
+
+    // values are already json; never blocks on the reader of the stream
+    void emit(std::string_view event, std::initializer_list<std::pair<std::string_view, std::string>> values = {});
+
+private:
+    void write_events(std::stop_token stop);
+
+    int m_fd;
+    std::mutex m_mutex;
+    std::condition_variable_any m_pending;
+    std::deque<std::string> m_events;
+    std::size_t m_dropped{};
+    // last, so the writer stops (and flushes) before the rest is gone
+    std::jthread m_writer;
+};
+
+/**
+ * @brief Pages of each document (by position in documents) that contain a term.
+ */
+using index_postings = std::vector<std::pair<std::uint32_t, std::vector<std::uint32_t>>>;
+
+/**
+ * @brief One segment of the full-text index.
+ * Segment files are never changed once written; new documents get a new segment and segments are merged once there are too many.
+ */
+struct index_segment {
+    std::vector<std::string> documents;
+    std::map<std::string, index_postings, std::less<>> postings;
+};
+
+/**
+ * @brief Lock on the index directory; writers (adding and merging segments) take it exclusively, searches shared.
+ */
+class index_lock {
+public:
+    index_lock(const std::filesystem::path& index_path, bool exclusive);
+    ~index_lock();
+
+    index_lock(const index_lock&) = delete;
+    index_lock& operator=(const index_lock&) = delete;
+
+private:
+    int m_fd;
+};
+
+/**
+ * @brief What identifies a document in the fingerprint store (see --known).
+ */
+struct document_fingerprint {
+    std::vector<page_hash> page_hashes;
+    // minhash of the word pairs on the first page (empty if it has no text)
+    std::vector<std::uint32_t> text_signature;
+    std::filesystem::path document;
+};
+
+/**
+ * @brief A kept page that waits for its OCR until it is clear the document is not a known one.
+ */
+struct deferred_page {
+    Magick::Image image;
+    luma_image luma;
+    luma_histogram histogram;
+    bool back_side{};
+    std::optional<raw_frame> jpeg_frame;
+};
+
+/**
+ * @brief A frame ready for the pipeline.
+ * A jpeg frame is only decoded at a reduced size until we know its page cannot go into the pdf as it is.
+ */
+struct scanned_image {
+    Magick::Image image;
+    std::optional<raw_frame> jpeg_frame;
+};
+
+/**
+ * @brief What happened to a frame (or an item split out of one) in a job.
+ */
+struct page_record {
+    std::size_t frame{};
+    std::string decision;
+    std::optional<std::string> reduction;
+    std::optional<bool> has_text;
+    std::optional<int> orientation;
+    std::optional<double> deskew_angle;
+    std::optional<Magick::Geometry> crop;
+    bool pass_through{};
+};
+
+/**
+ * @brief Machine readable record of a job, saved to the jobs log directory.
+ */
+struct job_manifest {
+    std::string document;
+    std::string result;
+    std::optional<std::string> error;
+    // name, value and where the value came from
+    std::vector<std::tuple<std::string_view, std::string, std::string_view>> fields;
+    std::vector<page_record> pages;
+    std::map<std::string, std::chrono::milliseconds> stage_times;
+    std::map<std::string, std::uintmax_t> byte_counts;
+};
+
+enum class known_document_action {
+    keep,
+    skip,
+    link
+};
+
+enum class job_priority {
+    interactive,
+    bulk
+};
+
+std::string to_filename_field(const std::string& value);
+std::string to_json_string(std::string_view value);
+void write_text_output(const std::filesystem::path& path, const std::vector<std::string>& page_texts, const std::optional<document_fields>& fields);
+void save_job_manifest(const std::filesystem::path& jobs_path, const job_manifest& manifest);
+std::optional<document_fields> parse_barcode_fields(const std::string& payload);
+std::optional<document_fields> get_barcode_fields(const luma_image& luma);
+
+raw_frame get_next_frame(hyx::sane_device* device, SANE_Int resolution);
+Magick::Image frame_to_image(const raw_frame& frame);
+Magick::Image jpeg_frame_to_proxy(const raw_frame& frame, SANE_Int resolution);
+scanned_image get_scanned_image(raw_frame frame);
+bool is_pass_through_jpeg(Magick::Image proxy, const scan2pdf_config& config);
+
+std::vector<std::string> get_index_terms(const std::string& text);
+void put_varint(std::string& out, std::uint64_t value);
+std::uint64_t get_varint(std::string_view& in);
+index_segment read_index_segment(const std::filesystem::path& path, const std::vector<std::string>& only_terms = {});
+void write_index_segment(const std::filesystem::path& path, const index_segment& segment);
+std::vector<std::filesystem::path> get_index_segments(const std::filesystem::path& index_path);
+std::size_t get_index_tier(std::uintmax_t segment_size);
+void merge_index_segments(const std::vector<std::filesystem::path>& segments);
+index_segment get_index_segment(const std::filesystem::path& document, const std::vector<std::string>& page_texts);
+void add_to_index(const std::filesystem::path& index_path, const index_segment& segment);
+int search_index(const std::filesystem::path& index_path, const std::string& query);
+
+std::vector<std::uint32_t> get_text_signature(const std::string& text);
+double get_text_similarity(const std::vector<std::uint32_t>& lhs, const std::vector<std::uint32_t>& rhs);
+std::vector<document_fingerprint> load_fingerprints(const std::filesystem::path& path);
+void save_fingerprint(const std::filesystem::path& path, const document_fingerprint& fingerprint);
+const document_fingerprint* find_known_document(const std::vector<const document_fingerprint*>& candidates, const document_fingerprint& fingerprint);
+
+void set_job_priority(job_priority priority);
 
 void print_help();
 void print_version();
 
-void set_device_options(hyx::sane_device* device);
+std::vector<std::pair<std::string_view, double*>> get_config_values(scan2pdf_config& config);
+scan2pdf_config load_config(const std::filesystem::path& path, bool required = false);
+void save_config(const std::filesystem::path& path, scan2pdf_config config);
 
-void proccess(Magick::Image& image);
-std::string get_trim_shadow_bounds(Magick::Image image);
-double get_deskew_angle(Magick::Image image);
-void deskew(Magick::Image& image);
+void set_device_options(hyx::sane_device* device);
+page_class get_preview_class(hyx::sane_device* device, const scan2pdf_config& config);
+
+page_geometry proccess(Magick::Image& image, const std::optional<page_geometry>& front_geometry = std::nullopt);
+bool is_blank_back_side(Magick::Image image, const page_geometry& front_geometry, const scan2pdf_config& config);
+std::vector<Magick::Image> split_items(const Magick::Image& image);
+void proccess_items(std::vector<Magick::Image>& items);
+std::string get_trim_shadow_bounds(Magick::Image image, const luma_histogram& histogram);
+double get_deskew_angle(Magick::Image image, const luma_histogram& histogram);
+void deskew(Magick::Image& image, double deskew_angle);
 std::string get_trim_edges_bounds(Magick::Image image);
 
-void transform_to_bw(Magick::Image& image);
-void transform_with_text_to_bw(Magick::Image& image);
+luma_image get_luma(Magick::Image image);
+luma_histogram get_luma_histogram(const luma_image& luma);
+luma_histogram gamma_luma_histogram(const luma_histogram& histogram, double gamma);
+std::uint8_t get_otsu_threshold(const luma_histogram& histogram);
+void set_luma(Magick::Image& image, const luma_image& luma, Magick::ImageType type);
+template <typename Function>
+void for_each_band(std::size_t height, Function&& func);
+template <typename Function>
+void for_each_window_stats(const luma_image& luma, std::size_t y_begin, std::size_t y_end, std::size_t radius, Function&& func);
+luma_image adaptive_threshold(const luma_image& luma, threshold_method method, const luma_histogram& histogram);
+luma_image transform_to_bw(Magick::Image& image, const luma_image& luma, const luma_histogram& histogram);
+luma_image transform_with_text_to_bw(Magick::Image& image, const luma_image& luma, const luma_histogram& histogram);
 void transform_to_grayscale(Magick::Image& image);
-int get_orientation(tesseract::TessBaseAPI* tess_api, PIX* pimage);
-bool is_grayscale(Magick::Image image);
-bool is_bw(Magick::Image image);
-bool is_white(Magick::Image image);
-bool has_text(tesseract::TessBaseAPI* tess_api, PIX* pimage);
+void transform_to_palette(Magick::Image& image, std::size_t colors);
+saturation_stats get_saturation_stats(Magick::Image image);
+bool is_grayscale(const saturation_stats& stats, const scan2pdf_config& config);
+std::size_t get_palette_colors(Magick::Image image);
+gray_stats get_solarized_gray_stats(const luma_histogram& histogram);
+bool is_bw(const gray_stats& stats, const scan2pdf_config& config);
+double get_percent_white(const luma_histogram& histogram);
+bool is_white(double percent_white, const scan2pdf_config& config);
+page_hash get_page_hash(const luma_image& luma);
+bool is_duplicate_page(const page_hash& hash, std::deque<page_hash>& recent_hashes);
 PIX* magick2pix(Magick::Image& image);
-std::string get_text(tesseract::TessBaseAPI* tess_api, PIX* pimage);
+PIX* bilevel2pix(const luma_image& bilevel, int resolution);
+
+page_class classify_page(const page_features& features, const scan2pdf_config& config);
+std::array<std::array<std::size_t, 4>, 4> get_confusion_matrix(const std::vector<std::pair<page_class, page_features>>& samples, const scan2pdf_config& config);
+double get_misclassification_cost(const std::vector<std::pair<page_class, page_features>>& samples, const scan2pdf_config& config);
+void print_confusion_matrix(const std::array<std::array<std::size_t, 4>, 4>& confusion_matrix);
+scan2pdf_config calibrate_thresholds(const std::vector<std::pair<page_class, page_features>>& samples, scan2pdf_config config);
+int calibrate(const std::filesystem::path& corpus_path, const std::filesystem::path& config_path, const scan2pdf_config& config);
+
+/**
+ * @brief OCR state of a single page.
+ * The image is given to tesseract once and the orientation and text are only computed once.
+ */
+class ocr_page {
+public:
+    ocr_page(tesseract::TessBaseAPI* tess_api, PIX* pimage, std::optional<int> orientation_prior = std::nullopt);
+
+    int orientation();
+    const std::string& text();
+    bool has_text();
+
+private:
+    tesseract::TessBaseAPI* m_tess_api;
+    hyx::unique_pix m_pimage;
+    std::optional<int> m_orientation_prior;
+    std::optional<int> m_orientation;
+    std::optional<std::string> m_text;
+};
 
 /**
  * @brief Global options.
@@ -107,6 +620,10 @@ static std::unordered_map<std::string, std::any> sane_options{
     {SANE_NAME_PAGE_WIDTH, std::numeric_limits<SANE_Word>::max()},
     {"ald", true}};
 
+// set by SIGHUP; a changed config is checked at the next page and applies from the next job on
+static std::atomic<bool> reload_config_requested{false};
+static_assert(std::atomic<bool>::is_always_lock_free);
+
 constexpr void dump_image([[maybe_unused]] Magick::Image& img, [[maybe_unused]] const std::string& name)
 {
 #ifdef DEBUG
@@ -135,6 +652,12 @@ constexpr double quantum_to_percent(std::convertible_to<double> auto quantum)
     return (static_cast<double>(quantum) / MaxMap) * percent_max;
 }
 
+constexpr double luma_to_quantum(std::convertible_to<double> auto luma)
+{
+    constexpr auto luma_max{255.0};
+    return (static_cast<double>(luma) / luma_max) * MaxMap;
+}
+
 std::string get_current_date()
 {
     return std::format("{:%Y-%m-%d}", std::chrono::system_clock::now());
@@ -150,186 +673,1326 @@ std::string parse_organization(const std::string& text, const std::string& defau
     }
 }
 
-Magick::Image get_next_image(hyx::sane_device* device)
+std::string to_filename_field(const std::string& value)
 {
-    const auto sane_params{device->get_parameters()};
+    // keep the field safe for a filename, also on a windows share (and for regex_replace, which would read '$' as a
+    // group). only separators, reserved characters, whitespace and control characters go, so names outside of ascii
+    // (e.g., 'Müller AG') keep their letters
+    const auto field{std::regex_replace(value, std::regex(R"([\s/\\:*?"<>|$\x00-\x1f\x7f]+)"), "-")};
+    const auto first{field.find_first_not_of('-')};
+    return (first == std::string::npos) ? "" : field.substr(first, field.find_last_not_of('-') - first + 1);
+}
 
-    std::ostringstream tiff_ostream;
-    auto* tifffile{TIFFStreamOpen("tiff_frame", &tiff_ostream)};
-    TIFFSetField(tifffile, TIFFTAG_IMAGEWIDTH, sane_params.pixels_per_line);
-    TIFFSetField(tifffile, TIFFTAG_IMAGELENGTH, (sane_params.lines != -1) ? sane_params.lines : 0);
-    TIFFSetField(tifffile, TIFFTAG_BITSPERSAMPLE, sane_params.depth);
-    TIFFSetField(tifffile, TIFFTAG_SAMPLESPERPIXEL, 3);
-    TIFFSetField(tifffile, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(tifffile, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(tifffile, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
-    TIFFSetField(tifffile, TIFFTAG_SOFTWARE, "scan2pdf");
-    TIFFSetField(tifffile, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
-    TIFFSetField(tifffile, TIFFTAG_XRESOLUTION, 300);
-    TIFFSetField(tifffile, TIFFTAG_YRESOLUTION, 300);
-    TIFFSetField(tifffile, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(tifffile, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tifffile, (uint32_t)-1));
+std::optional<document_fields> parse_barcode_fields(const std::string& payload)
+{
+    std::vector<std::string> lines;
+    for (const auto& line : payload | std::views::split('\n')) {
+        auto& new_line{lines.emplace_back(line.begin(), line.end())};
+        if (new_line.ends_with('\r')) {
+            new_line.pop_back();
+        }
+    }
 
-    const auto buf_size{sane_params.bytes_per_line};
-    std::unique_ptr<SANE_Byte, decltype(&_TIFFfree)> data{static_cast<SANE_Byte*>(_TIFFmalloc(buf_size)), &_TIFFfree};
-    for (auto row{0u}; device->read(data.get(), buf_size); ++row) {
-        if (TIFFWriteScanline(tifffile, data.get(), row) != 1) {
-            logger(hyx::logger_literals::warning, "bad write!\n");
-            throw std::runtime_error("Bad image write");
+    document_fields fields;
+
+    // EPC (SEPA credit transfer) QR code: name on line 6, then a structured or unstructured reference on line 10 or 11
+    constexpr std::size_t epc_name_line{5};
+    constexpr std::size_t epc_reference_line{9};
+    constexpr std::size_t epc_remittance_line{10};
+    // swiss QR bill: creditor name on line 6, then a reference or message on line 29 or 30
+    constexpr std::size_t spc_name_line{5};
+    constexpr std::size_t spc_reference_line{28};
+    constexpr std::size_t spc_message_line{29};
+
+    if (lines.size() > epc_name_line && lines.front() == "BCD") {
+        fields.organization = lines[epc_name_line];
+        if (lines.size() > epc_reference_line && !lines[epc_reference_line].empty()) {
+            fields.transaction = lines[epc_reference_line];
+        }
+        else if (lines.size() > epc_remittance_line) {
+            fields.transaction = lines[epc_remittance_line];
+        }
+    }
+    else if (lines.size() > spc_message_line && lines.front() == "SPC") {
+        fields.organization = lines[spc_name_line];
+        fields.transaction = !lines[spc_reference_line].empty() ? lines[spc_reference_line] : lines[spc_message_line];
+    }
+    else {
+        // anything else has to spell out its fields (e.g., 'vendor=acme&invoice=1234' or 'vendor: acme; invoice: 1234')
+        const std::unordered_map<std::string, std::optional<std::string> document_fields::*> field_keys{
+            {"vendor", &document_fields::organization},
+            {"org", &document_fields::organization},
+            {"organization", &document_fields::organization},
+            {"company", &document_fields::organization},
+            {"merchant", &document_fields::organization},
+            {"date", &document_fields::date},
+            {"invoice_date", &document_fields::date},
+            {"store", &document_fields::store},
+            {"branch", &document_fields::store},
+            {"invoice", &document_fields::transaction},
+            {"invoice_number", &document_fields::transaction},
+            {"invoice_no", &document_fields::transaction},
+            {"transaction", &document_fields::transaction},
+            {"receipt", &document_fields::transaction}};
+
+        const std::regex field_regex(R"((\w+)\s*[=:]\s*([^&;\n]+))");
+        for (auto match_it{std::sregex_iterator(payload.begin(), payload.end(), field_regex)}; match_it != std::sregex_iterator(); ++match_it) {
+            auto key{match_it->str(1)};
+            std::ranges::transform(key, key.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (const auto field_key{field_keys.find(key)}; field_key != field_keys.end()) {
+                fields.*(field_key->second) = match_it->str(2);
+            }
         }
     }
 
-    //! FIXME: if we throw, the file is not closed
-    TIFFClose(tifffile);
+    // drop anything that did not survive being made filename safe
+    for (auto* field : {&fields.organization, &fields.date, &fields.store, &fields.transaction}) {
+        if (*field) {
+            *field = to_filename_field(**field);
+            if ((*field)->empty()) {
+                field->reset();
+            }
+        }
+    }
 
-    // since we read the exact number of bytes per line we don't get EOF until the next call.
-    // if the next call doesn't read zero bytes or return EOF, we have image bytes that were not read.
-    if (device->read(data.get(), buf_size)) [[unlikely]] {
-        throw std::runtime_error("Remaining bytes after image read");
+    // same style as guess_organization()
+    if (fields.organization) {
+        std::ranges::transform(*fields.organization, fields.organization->begin(), [](unsigned char c) { return std::tolower(c); });
     }
 
-    return {Magick::Blob(tiff_ostream.view().data(), tiff_ostream.view().size())};
-}
+    if (!fields.organization && !fields.date && !fields.store && !fields.transaction) {
+        return std::nullopt;
+    }
 
-void print_help()
-{
-    std::cout << "Usage: scan2pdf [options...] file\n";
-    std::cout << '\n';
-    std::cout << "-r, --resolution     sets the resolution of the scanned image [50...600]dpi\n";
-    std::cout << "-o, --output-path    save the file to a given directory\n";
+    return fields;
 }
 
-void print_version()
+std::optional<document_fields> get_barcode_fields([[maybe_unused]] const luma_image& luma)
 {
-    std::cout << "scan2pdf " << global::version << '\n';
-    std::cout << "Copyright (C) 2022-2023 Michael Pollak\n";
-    std::cout << "License Apache-2.0: Apache License, Version 2.0 <https://www.apache.org/licenses/LICENSE-2.0>\n";
-    std::cout << '\n';
-    std::cout << "Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an \"AS IS\" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.\n";
+#ifdef HAVE_ZBAR
+    logger("Looking for barcodes\n");
+
+    // we use the full analysis luma since thin barcode bars do not survive downscaling
+    zbar::ImageScanner scanner;
+    scanner.set_config(zbar::ZBAR_NONE, zbar::ZBAR_CFG_ENABLE, 1);
+    zbar::Image zimage(static_cast<unsigned>(luma.width), static_cast<unsigned>(luma.height), "Y800", luma.pixels.data(), luma.pixels.size());
+    scanner.scan(zimage);
+
+    for (auto symbol{zimage.symbol_begin()}; symbol != zimage.symbol_end(); ++symbol) {
+        logger(hyx::logger_literals::debug, "Found {} barcode\n", symbol->get_type_name());
+        if (auto fields{parse_barcode_fields(symbol->get_data())}; fields) {
+            return fields;
+        }
+    }
+#else
+    // auto mode still works from the text, it just cannot use barcodes
+    static std::once_flag warned;
+    std::call_once(warned, [] { logger(hyx::logger_literals::warning, "scan2pdf was built without zbar: barcodes are not read\n"); });
+#endif // !HAVE_ZBAR
+
+    return std::nullopt;
 }
 
-void set_device_options(hyx::sane_device* device)
+std::string to_json_string(std::string_view value)
 {
-    for (const auto& opt : device->get_options()) {
-        if (sane_options.contains(opt->name)) {
-            if (const auto bop{dynamic_cast<hyx::sane_device::bool_option*>(opt)}) {
-                device->set_option(bop, static_cast<SANE_Bool>(std::any_cast<bool>(sane_options.at(opt->name))));
-            }
-            else if (const auto fop{dynamic_cast<hyx::sane_device::fixed_option*>(opt)}) {
-                device->set_option(fop, std::any_cast<SANE_Fixed>(sane_options.at(opt->name)));
-            }
-            else if (const auto iop{dynamic_cast<hyx::sane_device::int_option*>(opt)}) {
-                device->set_option(iop, std::any_cast<SANE_Int>(sane_options.at(opt->name)));
+    std::string json{'"'};
+    for (const auto c : value) {
+        switch (c) {
+        case '"':
+            json += "\\\"";
+            break;
+        case '\\':
+            json += "\\\\";
+            break;
+        case '\n':
+            json += "\\n";
+            break;
+        case '\t':
+            json += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                json += std::format("\\u{:04x}", static_cast<unsigned>(c));
             }
-            else if (const auto sop{dynamic_cast<hyx::sane_device::string_option*>(opt)}) {
-                //! FIXME: const_cast is a bad idea (but last resort for now).
-                device->set_option(sop, const_cast<SANE_String>(std::any_cast<SANE_String_Const>(sane_options.at(opt->name))));
+            else {
+                json += c;
             }
         }
     }
+    json += '"';
+
+    return json;
 }
 
-void proccess(Magick::Image& image)
+void write_text_output(const std::filesystem::path& path, const std::vector<std::string>& page_texts, const std::optional<document_fields>& fields)
 {
-    // basic image changes
-    image.despeckle();
-    image.enhance();
-    image.alpha(false);
-
-    deskew(image);
-    image.repage();
-
-    // crop the scan edges of the image
-    image.crop(get_trim_edges_bounds(image));
-    image.repage();
+    auto text_path{path};
+    text_path += ".txt";
+    auto json_path{path};
+    json_path += ".json";
+
+    // pages are split by form feeds like pdftotext does
+    std::ofstream text_file(text_path);
+    for (auto sep{""}; const auto& text : page_texts) {
+        text_file << sep << text;
+        sep = "\f";
+    }
 
-    // remove the shadow on the top of the image
-    image.crop(get_trim_shadow_bounds(image));
-    image.repage();
+    std::ofstream json_file(json_path);
+    json_file << "{\n";
+    json_file << "  \"document\": " << to_json_string(text_path.filename().string()) << ",\n";
+    json_file << "  \"pages\": " << page_texts.size() << ",\n";
+    json_file << "  \"fields\": {";
+    if (fields) {
+        const std::array<std::pair<std::string_view, const std::optional<std::string>*>, 4> field_values{{
+            {"organization", &fields->organization},
+            {"date", &fields->date},
+            {"store", &fields->store},
+            {"transaction", &fields->transaction}}};
+        for (auto sep{""}; const auto& [name, field] : field_values) {
+            json_file << sep << "\n    \"" << name << "\": " << (*field ? to_json_string(**field) : "null");
+            sep = ",";
+        }
+        json_file << "\n  ";
+    }
+    json_file << "}\n";
+    json_file << "}\n";
 
-    image.gamma(global::scanner_gamma_fix);
+    if (!text_file || !json_file) {
+        throw std::runtime_error("Failed to write text output: \'" + path.string() + "\'");
+    }
 }
 
-double get_deskew_angle(Magick::Image image)
+void save_job_manifest(const std::filesystem::path& jobs_path, const job_manifest& manifest)
 {
-    logger(hyx::logger_literals::debug, "Getting deskew angle\n");
+    std::filesystem::create_directories(jobs_path);
+    const auto now{std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now())};
+    const auto manifest_path{jobs_path / std::format("{:%Y%m%dT%H%M%SZ}_{}.json", now, getpid())};
+
+    const auto optional_json{[](const auto& value, auto&& to_json) { return value ? std::string(to_json(*value)) : std::string("null"); }};
+
+    std::ofstream manifest_file(manifest_path);
+    manifest_file << "{\n";
+    manifest_file << "  \"version\": " << to_json_string(global::version) << ",\n";
+    manifest_file << "  \"document\": " << to_json_string(manifest.document) << ",\n";
+    manifest_file << "  \"result\": " << to_json_string(manifest.result) << ",\n";
+    manifest_file << "  \"error\": " << optional_json(manifest.error, to_json_string) << ",\n";
+
+    manifest_file << "  \"fields\": {";
+    for (auto sep{""}; const auto& [name, value, source] : manifest.fields) {
+        manifest_file << sep << "\n    \"" << name << "\": {\"value\": " << to_json_string(value) << ", \"source\": " << to_json_string(source) << '}';
+        sep = ",";
+    }
+    manifest_file << (manifest.fields.empty() ? "},\n" : "\n  },\n");
+
+    manifest_file << "  \"pages\": [";
+    for (auto sep{""}; const auto& page : manifest.pages) {
+        manifest_file << sep << "\n    {";
+        manifest_file << "\"frame\": " << page.frame;
+        manifest_file << ", \"decision\": " << to_json_string(page.decision);
+        manifest_file << ", \"reduction\": " << optional_json(page.reduction, to_json_string);
+        manifest_file << ", \"has_text\": " << optional_json(page.has_text, [](bool has_text) { return has_text ? "true" : "false"; });
+        manifest_file << ", \"orientation\": " << optional_json(page.orientation, [](int orientation) { return std::to_string(orientation); });
+        manifest_file << ", \"deskew_angle\": " << optional_json(page.deskew_angle, [](double angle) { return std::format("{:.3f}", angle); });
+        manifest_file << ", \"crop\": " << optional_json(page.crop, [](const Magick::Geometry& crop) { return std::format("{{\"x\": {}, \"y\": {}, \"width\": {}, \"height\": {}}}", crop.xOff(), crop.yOff(), crop.width(), crop.height()); });
+        manifest_file << ", \"pass_through\": " << (page.pass_through ? "true" : "false");
+        manifest_file << '}';
+        sep = ",";
+    }
+    manifest_file << (manifest.pages.empty() ? "],\n" : "\n  ],\n");
 
-    // reducing the image size will greatly improve deskew time and accuracy due to less pixels and 'fuzzing'
-    image.resize("10%");
-    image.autoThreshold(Magick::OTSUThresholdMethod);
-    image.deskew(80_quantum_percent);
+    manifest_file << "  \"stage_ms\": {";
+    for (auto sep{""}; const auto& [stage, time] : manifest.stage_times) {
+        manifest_file << sep << "\n    " << to_json_string(stage) << ": " << time.count();
+        sep = ",";
+    }
+    manifest_file << (manifest.stage_times.empty() ? "},\n" : "\n  },\n");
 
-    // note: negative since the image got flipped
-    return std::stod(image.artifact("deskew:angle"));
+    manifest_file << "  \"bytes\": {";
+    for (auto sep{""}; const auto& [name, bytes] : manifest.byte_counts) {
+        manifest_file << sep << "\n    " << to_json_string(name) << ": " << bytes;
+        sep = ",";
+    }
+    manifest_file << (manifest.byte_counts.empty() ? "}\n" : "\n  }\n");
+    manifest_file << "}\n";
+
+    if (!manifest_file) {
+        throw std::runtime_error("Failed to write job manifest: \'" + manifest_path.string() + "\'");
+    }
 }
 
-void deskew(Magick::Image& image)
+raw_frame get_next_frame(hyx::sane_device* device, SANE_Int resolution)
 {
-    logger("Deskewing image\n");
+    raw_frame frame{.params = device->get_parameters(), .resolution = resolution};
+
+    if (frame.params.format == global::sane_frame_jpeg) {
+        // there are no lines in a jpeg stream, so we read chunks until EOF and drop whatever follows the end of image marker.
+        // a read can return less than a chunk before the end of the stream, so only what it returned is kept
+        constexpr std::size_t chunk_size{64 * 1024};
+        std::size_t size{};
+        for (;;) {
+            frame.data.resize(size + chunk_size);
+            const auto length{device->read(frame.data.data() + size, static_cast<SANE_Int>(chunk_size))};
+            if (length <= 0) {
+                break;
+            }
+            size += static_cast<std::size_t>(length);
+        }
+        frame.data.resize(size);
 
-    // Find the color of the scan background.
-    const auto background_color{image.pixelColor(5, 5)};
-    image.backgroundColor(background_color);
-    logger(hyx::logger_literals::debug, "Set background color to ({},{},{})\n", quantum_as_rgb(background_color.quantumRed()), quantum_as_rgb(background_color.quantumGreen()), quantum_as_rgb(background_color.quantumBlue()));
+        constexpr std::array<SANE_Byte, 2> end_of_image{0xFF, 0xD9};
+        const auto eoi{std::ranges::find_end(frame.data, end_of_image)};
+        if (eoi.empty()) {
+            throw std::runtime_error("Incomplete jpeg frame");
+        }
+        frame.data.erase(eoi.end(), frame.data.end());
 
+        return frame;
+    }
 
-    const auto deskew_angle{get_deskew_angle(image)};
-    image.rotate(deskew_angle);
-    logger(hyx::logger_literals::debug, "Deskewed by {} degrees\n", deskew_angle);
+    const auto buf_size{static_cast<std::size_t>(frame.params.bytes_per_line)};
+    if (frame.params.lines != -1) {
+        frame.data.reserve(buf_size * static_cast<std::size_t>(frame.params.lines));
+    }
 
-    dump_image(image, "deskewed");
+    std::vector<SANE_Byte> line(buf_size);
+    while (device->read(line.data(), static_cast<SANE_Int>(buf_size))) {
+        frame.data.insert(frame.data.end(), line.begin(), line.end());
+    }
+
+    // since we read the exact number of bytes per line we don't get EOF until the next call.
+    // if the next call doesn't read zero bytes or return EOF, we have image bytes that were not read.
+    if (device->read(line.data(), static_cast<SANE_Int>(buf_size))) [[unlikely]] {
+        throw std::runtime_error("Remaining bytes after image read");
+    }
+
+    // hand-scanners and some ADFs do not know the length of the page up front
+    frame.params.lines = static_cast<SANE_Int>(frame.data.size() / buf_size);
+
+    return frame;
 }
 
-std::string get_trim_edges_bounds(Magick::Image image)
+Magick::Image frame_to_image(const raw_frame& frame)
 {
-    // magick in.png -fuzz 10% -set MBB '%[minimum-bounding-box]' -fill black -colorize 100 -fill white -draw "polygon %[MBB]" -define trim:percent-background=0 -trim -format "%wx%h%X%Y" info:
+    const auto& sane_params{frame.params};
 
-    logger("Trimming edges\n");
+    if (sane_params.format == global::sane_frame_jpeg) {
+        Magick::Image image(Magick::Blob(frame.data.data(), frame.data.size()));
+        image.density(Magick::Point(frame.resolution));
+        return image;
+    }
 
-    // the colorFuzz value will influence the MBR
-    image.colorFuzz(10_quantum_percent);
-    // MBR = Minimum Bounding Rectangle
-    auto mbr{image.formatExpression("%[minimum-bounding-box]")};
+    if ((sane_params.format != SANE_FRAME_RGB) && (sane_params.format != SANE_FRAME_GRAY)) {
+        throw std::runtime_error("Unsupported frame format: " + std::to_string(sane_params.format));
+    }
+    const auto gray{sane_params.format == SANE_FRAME_GRAY};
 
-    // create our polygon coordinates
-    std::vector<Magick::Coordinate> mbr_coords;
-    for (const auto& coord : mbr | std::views::split(' ')) {
-        for (const auto& [x, y] : coord | std::views::split(',') | std::views::pairwise) {
-            mbr_coords.emplace_back(std::stod(std::string(x.begin(), x.end())), std::stod(std::string(y.begin(), y.end())));
+    std::ostringstream tiff_ostream;
+    auto* tifffile{TIFFStreamOpen("tiff_frame", &tiff_ostream)};
+    TIFFSetField(tifffile, TIFFTAG_IMAGEWIDTH, sane_params.pixels_per_line);
+    TIFFSetField(tifffile, TIFFTAG_IMAGELENGTH, sane_params.lines);
+    TIFFSetField(tifffile, TIFFTAG_BITSPERSAMPLE, sane_params.depth);
+    TIFFSetField(tifffile, TIFFTAG_SAMPLESPERPIXEL, gray ? 1 : 3);
+    TIFFSetField(tifffile, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    TIFFSetField(tifffile, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tifffile, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+    TIFFSetField(tifffile, TIFFTAG_SOFTWARE, "scan2pdf");
+    TIFFSetField(tifffile, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+    TIFFSetField(tifffile, TIFFTAG_XRESOLUTION, static_cast<float>(frame.resolution));
+    TIFFSetField(tifffile, TIFFTAG_YRESOLUTION, static_cast<float>(frame.resolution));
+    // SANE lineart is 1 for black
+    TIFFSetField(tifffile, TIFFTAG_PHOTOMETRIC, !gray ? PHOTOMETRIC_RGB : (sane_params.depth == 1) ? PHOTOMETRIC_MINISWHITE : PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tifffile, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tifffile, (uint32_t)-1));
+
+    // libtiff does not write from const buffers
+    std::vector<SANE_Byte> line(static_cast<std::size_t>(sane_params.bytes_per_line));
+    for (auto row{0u}; row < static_cast<unsigned>(sane_params.lines); ++row) {
+        const auto line_begin{frame.data.begin() + static_cast<std::ptrdiff_t>(row * line.size())};
+        std::copy(line_begin, line_begin + static_cast<std::ptrdiff_t>(line.size()), line.begin());
+        if (TIFFWriteScanline(tifffile, line.data(), row) != 1) {
+            TIFFClose(tifffile);
+            logger(hyx::logger_literals::warning, "bad write!\n");
+            throw std::runtime_error("Bad image write");
         }
     }
 
-    // create a black background and white box over the MBR so we can easily trim to it.
-    constexpr auto colorize_alpha{100u};
-    image.colorize(colorize_alpha, "black");
-    image.fillColor("white");
-    image.draw(Magick::DrawablePolygon(mbr_coords));
-    image.artifact("trim:percent-background", "0");
+    TIFFClose(tifffile);
 
-    dump_image(image, "trim_edges_before_trim");
+    return {Magick::Blob(tiff_ostream.view().data(), tiff_ostream.view().size())};
+}
 
-    image.trim();
+Magick::Image jpeg_frame_to_proxy(const raw_frame& frame, SANE_Int resolution)
+{
+    const Magick::Blob blob(frame.data.data(), frame.data.size());
 
-    dump_image(image, "trim_edges");
+    Magick::Image header;
+    header.ping(blob);
+    const auto scale{static_cast<double>(resolution) / static_cast<double>(frame.resolution)};
 
-    return image.formatExpression("%wx%h%X%Y");
+    // libjpeg decodes straight to (the next 1/8 step above) this size by skipping DCT coefficients
+    Magick::Image proxy;
+    proxy.defineValue("jpeg", "size", std::format("{}x{}", static_cast<std::size_t>(static_cast<double>(header.columns()) * scale), static_cast<std::size_t>(static_cast<double>(header.rows()) * scale)));
+    proxy.read(blob);
+    proxy.density(Magick::Point(static_cast<double>(frame.resolution) * static_cast<double>(proxy.columns()) / static_cast<double>(header.columns())));
+    logger(hyx::logger_literals::debug, "Decoded {}x{} jpeg frame as a {}x{} proxy\n", header.columns(), header.rows(), proxy.columns(), proxy.rows());
+
+    return proxy;
 }
 
-std::string get_trim_shadow_bounds(Magick::Image image)
+scanned_image get_scanned_image(raw_frame frame)
 {
-    logger("Trimming shadow\n");
-
-    image.gamma(global::scanner_gamma_fix);
-    constexpr auto blur_radius{0.0};
-    constexpr auto blur_sigma{5.0};
-    image.adaptiveBlur(blur_radius, blur_sigma);
-    image.negate();
-    image.autoThreshold(Magick::OTSUThresholdMethod);
-    image.negate();
-    image.artifact("trim:percent-background", "5");
-    image.artifact("trim:background-color", "black");
+    if ((frame.params.format == global::sane_frame_jpeg) && (frame.resolution > global::jpeg_proxy_resolution)) {
+        auto proxy{jpeg_frame_to_proxy(frame, global::jpeg_proxy_resolution)};
+        return {std::move(proxy), std::move(frame)};
+    }
 
-    dump_image(image, "trim_shadow_before_trim");
+    return {frame_to_image(frame), std::nullopt};
+}
+
+bool is_pass_through_jpeg(Magick::Image proxy, const scan2pdf_config& config)
+{
+    // the page can only go into the pdf as the scanner compressed it if we would not change its pixels
+    // (scanners that compress their frames already did their own enhancement and gamma).
+    constexpr auto max_deskew_angle{0.1};
+    constexpr auto min_trim_percent{0.99};
+
+    const auto histogram{get_luma_histogram(get_luma(proxy))};
+    if (is_bw(get_solarized_gray_stats(histogram), config)) {
+        return false;
+    }
+
+    if (const auto deskew_angle{get_deskew_angle(proxy, histogram)}; std::abs(deskew_angle) > max_deskew_angle) {
+        logger(hyx::logger_literals::debug, "Jpeg frame needs to be deskewed by {} degrees\n", deskew_angle);
+        return false;
+    }
+
+    if (const Magick::Geometry trim_edges{get_trim_edges_bounds(proxy)}; (static_cast<double>(trim_edges.width()) < static_cast<double>(proxy.columns()) * min_trim_percent) || (static_cast<double>(trim_edges.height()) < static_cast<double>(proxy.rows()) * min_trim_percent)) {
+        logger(hyx::logger_literals::debug, "Jpeg frame needs to be trimmed\n");
+        return false;
+    }
+
+    return !is_grayscale(get_saturation_stats(proxy), config) && (get_palette_colors(proxy) == 0);
+}
+
+std::vector<std::string> get_index_terms(const std::string& text)
+{
+    // a term is a run of letters and digits; anything outside of ascii is kept as-is
+    constexpr std::size_t min_term_length{2};
+    constexpr std::size_t max_term_length{64};
+
+    std::vector<std::string> terms;
+    std::string term;
+    for (const auto c : text + ' ') {
+        if (const auto uc{static_cast<unsigned char>(c)}; std::isalnum(uc) || (uc >= 0x80)) {
+            term += static_cast<char>(std::tolower(uc));
+        }
+        else {
+            if (term.size() >= min_term_length && term.size() <= max_term_length) {
+                terms.push_back(term);
+            }
+            term.clear();
+        }
+    }
+
+    return terms;
+}
+
+void put_varint(std::string& out, std::uint64_t value)
+{
+    // 7 bits at a time; the high bit says there is more
+    for (; value >= 0x80; value >>= 7) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+    }
+    out += static_cast<char>(value);
+}
+
+std::uint64_t get_varint(std::string_view& in)
+{
+    std::uint64_t value{};
+    for (auto shift{0}; shift < 64; shift += 7) {
+        if (in.empty()) {
+            break;
+        }
+
+        const auto byte{static_cast<std::uint8_t>(in.front())};
+        in.remove_prefix(1);
+        value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+
+    throw std::runtime_error("Corrupt index segment");
+}
+
+index_segment read_index_segment(const std::filesystem::path& path, const std::vector<std::string>& only_terms)
+{
+    std::ifstream segment_file(path, std::ios::binary);
+    const std::string contents{std::istreambuf_iterator<char>(segment_file), std::istreambuf_iterator<char>()};
+    if (!contents.starts_with(global::index_magic)) {
+        throw std::runtime_error("Not an index segment: \'" + path.string() + "\'");
+    }
+
+    std::string_view in{contents};
+    in.remove_prefix(global::index_magic.size());
+    const auto get_bytes{[&in](std::size_t size) {
+        if (size > in.size()) {
+            throw std::runtime_error("Corrupt index segment");
+        }
+        const auto bytes{in.substr(0, size)};
+        in.remove_prefix(size);
+        return bytes;
+    }};
+
+    index_segment segment;
+    segment.documents.resize(get_varint(in));
+    for (auto& document : segment.documents) {
+        document = get_bytes(get_varint(in));
+    }
+
+    for (auto term_count{get_varint(in)}; term_count > 0; --term_count) {
+        const auto term{get_bytes(get_varint(in))};
+        auto postings_bytes{get_bytes(get_varint(in))};
+
+        // a query only needs the postings of its own terms
+        if (!only_terms.empty() && std::ranges::find(only_terms, term) == only_terms.end()) {
+            continue;
+        }
+
+        // documents and pages are stored as deltas from the previous one
+        auto& postings{segment.postings[std::string(term)]};
+        for (std::uint32_t document{}; !postings_bytes.empty();) {
+            document += static_cast<std::uint32_t>(get_varint(postings_bytes));
+            auto& [doc, pages]{postings.emplace_back(document, std::vector<std::uint32_t>(get_varint(postings_bytes)))};
+            for (std::uint32_t page{}; auto& p : pages) {
+                page += static_cast<std::uint32_t>(get_varint(postings_bytes));
+                p = page;
+            }
+        }
+    }
+
+    return segment;
+}
+
+void write_index_segment(const std::filesystem::path& path, const index_segment& segment)
+{
+    std::string out{global::index_magic};
+
+    put_varint(out, segment.documents.size());
+    for (const auto& document : segment.documents) {
+        put_varint(out, document.size());
+        out += document;
+    }
+
+    put_varint(out, segment.postings.size());
+    for (const auto& [term, postings] : segment.postings) {
+        std::string postings_bytes;
+        std::uint32_t prev_document{};
+        for (const auto& [document, pages] : postings) {
+            put_varint(postings_bytes, document - prev_document);
+            put_varint(postings_bytes, pages.size());
+            std::uint32_t prev_page{};
+            for (const auto page : pages) {
+                put_varint(postings_bytes, page - prev_page);
+                prev_page = page;
+            }
+            prev_document = document;
+        }
+
+        put_varint(out, term.size());
+        out += term;
+        put_varint(out, postings_bytes.size());
+        out += postings_bytes;
+    }
+
+    // readers only ever see complete segments
+    auto tmp_path{path};
+    tmp_path += ".tmp";
+    {
+        std::ofstream segment_file(tmp_path, std::ios::binary | std::ios::trunc);
+        segment_file.write(out.data(), static_cast<std::streamsize>(out.size()));
+        if (!segment_file) {
+            throw std::runtime_error("Failed to write index segment: \'" + tmp_path.string() + "\'");
+        }
+    }
+    std::filesystem::rename(tmp_path, path);
+}
+
+index_lock::index_lock(const std::filesystem::path& index_path, bool exclusive)
+    : m_fd{open((index_path / "lock").c_str(), exclusive ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644)}
+{
+    // an index nobody has written to yet (or that is read-only) has nothing to wait for
+    if (m_fd == -1) {
+        if (exclusive) {
+            throw std::runtime_error("Failed to open index lock: \'" + (index_path / "lock").string() + "\'");
+        }
+        return;
+    }
+
+    while (flock(m_fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+        if (errno != EINTR) {
+            const std::string error{std::strerror(errno)};
+            close(m_fd);
+            throw std::runtime_error("Failed to lock index: \'" + error + "\'");
+        }
+    }
+}
+
+index_lock::~index_lock()
+{
+    if (m_fd != -1) {
+        close(m_fd); // releases the lock
+    }
+}
+
+std::vector<std::filesystem::path> get_index_segments(const std::filesystem::path& index_path)
+{
+    std::vector<std::filesystem::path> segments;
+    if (std::filesystem::exists(index_path)) {
+        for (const auto& entry : std::filesystem::directory_iterator(index_path)) {
+            if (entry.path().extension() == ".seg") {
+                segments.push_back(entry.path());
+            }
+        }
+    }
+
+    // segments are named by generation, so oldest first
+    std::ranges::sort(segments, {}, [](const auto& segment) { return std::stoull(segment.stem().string()); });
+    return segments;
+}
+
+std::size_t get_index_tier(std::uintmax_t segment_size)
+{
+    std::size_t tier{};
+    for (auto tier_size{global::index_tier_floor}; segment_size > tier_size; tier_size *= global::index_merge_segments) {
+        ++tier;
+    }
+
+    return tier;
+}
+
+void merge_index_segments(const std::vector<std::filesystem::path>& segments)
+{
+    logger(hyx::logger_literals::debug, "Merging {} index segments\n", segments.size());
+
+    std::vector<index_segment> merging;
+    for (const auto& segment_path : segments) {
+        merging.push_back(read_index_segment(segment_path));
+    }
+
+    // a document written again under the same name only keeps its newest postings
+    std::vector<std::vector<bool>> superseded(merging.size());
+    std::set<std::string_view> newer_documents;
+    for (auto idx{merging.size()}; idx-- > 0;) {
+        for (const auto& document : merging[idx].documents) {
+            superseded[idx].push_back(!newer_documents.insert(document).second);
+        }
+    }
+
+    index_segment merged;
+    std::size_t dropped{};
+    for (std::size_t idx{}; idx < merging.size(); ++idx) {
+        auto& segment{merging[idx]};
+
+        std::vector<std::uint32_t> merged_document(segment.documents.size());
+        for (std::size_t document{}; document < segment.documents.size(); ++document) {
+            if (superseded[idx][document]) {
+                ++dropped;
+                continue;
+            }
+            merged_document[document] = static_cast<std::uint32_t>(merged.documents.size());
+            merged.documents.push_back(segment.documents[document]);
+        }
+
+        for (auto& [term, postings] : segment.postings) {
+            for (auto& [document, pages] : postings) {
+                if (!superseded[idx][document]) {
+                    merged.postings[term].emplace_back(merged_document[document], std::move(pages));
+                }
+            }
+        }
+    }
+    logger(hyx::logger_literals::debug, "Dropped {} superseded documents from the index\n", dropped);
+
+    // the merged segment takes the newest generation so it replaces the old ones in one rename
+    write_index_segment(segments.back(), merged);
+    for (const auto& segment_path : segments | std::views::take(segments.size() - 1)) {
+        std::filesystem::remove(segment_path);
+    }
+}
+
+index_segment get_index_segment(const std::filesystem::path& document, const std::vector<std::string>& page_texts)
+{
+    index_segment segment{.documents = {document.string()}};
+    for (std::uint32_t page{}; page < page_texts.size(); ++page) {
+        for (const auto& term : get_index_terms(page_texts[page])) {
+            if (auto& postings{segment.postings[term]}; postings.empty()) {
+                postings.emplace_back(0, std::vector{page});
+            }
+            else if (postings.back().second.back() != page) {
+                postings.back().second.push_back(page);
+            }
+        }
+    }
+
+    return segment;
+}
+
+void add_to_index(const std::filesystem::path& index_path, const index_segment& segment)
+{
+    // jobs that finish at the same time would otherwise take the same generation, or merge segments out from under each other
+    std::filesystem::create_directories(index_path);
+    const index_lock lock(index_path, true);
+
+    const auto last_segments{get_index_segments(index_path)};
+    const auto generation{last_segments.empty() ? 0 : std::stoull(last_segments.back().stem().string()) + 1};
+    write_index_segment(index_path / (std::to_string(generation) + ".seg"), segment);
+    logger(hyx::logger_literals::debug, "Indexed {} terms of {}\n", segment.postings.size(), segment.documents.front());
+
+    // segments are merged in tiers, so a document only gets rewritten about once per tier instead of on every merge
+    for (auto segments{get_index_segments(index_path)}; segments.size() >= global::index_merge_segments; segments = get_index_segments(index_path)) {
+        std::vector<std::size_t> tiers;
+        for (const auto& segment_path : segments) {
+            tiers.push_back(get_index_tier(std::filesystem::file_size(segment_path)));
+        }
+
+        // the newest segments merge along with the older ones of their tier (or below), but never across a bigger one:
+        // the newest copy of a document has to stay in the newest segment
+        const auto tier{std::ranges::max(tiers | std::views::drop(tiers.size() - global::index_merge_segments))};
+        const auto merge_count{std::ranges::find_if(tiers | std::views::reverse, [tier](auto segment_tier) { return segment_tier > tier; }) - (tiers | std::views::reverse).begin()};
+        merge_index_segments({segments.end() - merge_count, segments.end()});
+    }
+}
+
+int search_index(const std::filesystem::path& index_path, const std::string& query)
+{
+    auto terms{get_index_terms(query)};
+    std::ranges::sort(terms);
+    terms.erase(std::ranges::unique(terms).begin(), terms.end());
+    if (terms.empty()) {
+        std::cout << "Nothing to search for!\n";
+        return 1;
+    }
+
+    // a document matches on the pages that have every term; newest segments first
+    const index_lock lock(index_path, false);
+    std::map<std::string, std::vector<std::uint32_t>> matches;
+    std::set<std::string, std::less<>> newer_documents;
+    const auto segments{get_index_segments(index_path)};
+    for (const auto& segment_path : segments | std::views::reverse) {
+        const auto segment{read_index_segment(segment_path, terms)};
+        if (segment.postings.size() != terms.size()) {
+            newer_documents.insert(segment.documents.begin(), segment.documents.end());
+            continue;
+        }
+
+        std::optional<std::map<std::uint32_t, std::vector<std::uint32_t>>> segment_matches;
+        for (const auto& [term, postings] : segment.postings) {
+            std::map<std::uint32_t, std::vector<std::uint32_t>> term_matches;
+            for (const auto& [document, pages] : postings) {
+                if (!segment_matches) {
+                    term_matches[document] = pages;
+                }
+                else if (const auto match{segment_matches->find(document)}; match != segment_matches->end()) {
+                    std::vector<std::uint32_t> common_pages;
+                    std::ranges::set_intersection(match->second, pages, std::back_inserter(common_pages));
+                    if (!common_pages.empty()) {
+                        term_matches[document] = std::move(common_pages);
+                    }
+                }
+            }
+            segment_matches = std::move(term_matches);
+        }
+
+        // a rescanned document gets indexed again under the same name, and only its newest text counts
+        for (const auto& [document, pages] : *segment_matches) {
+            if (!newer_documents.contains(segment.documents.at(document))) {
+                matches[segment.documents.at(document)] = pages;
+            }
+        }
+        newer_documents.insert(segment.documents.begin(), segment.documents.end());
+    }
+
+    std::vector<std::pair<std::string, std::vector<std::uint32_t>>> results(matches.begin(), matches.end());
+    std::ranges::stable_sort(results, std::ranges::greater{}, [](const auto& result) { return result.second.size(); });
+    for (const auto& [document, pages] : results) {
+        std::cout << document << ": page";
+        if (pages.size() > 1) {
+            std::cout << 's';
+        }
+        for (auto sep{' '}; const auto page : pages) {
+            std::cout << sep << (page + 1);
+            sep = ',';
+        }
+        std::cout << '\n';
+    }
+
+    logger(hyx::logger_literals::debug, "Found {} documents for \'{}\'\n", results.size(), query);
+    return results.empty() ? 1 : 0;
+}
+
+std::vector<std::uint32_t> get_text_signature(const std::string& text)
+{
+    // OCR noise in spacing, case and punctuation does not change the terms, and a misread term only changes the two
+    // word pairs it is in, so two reads of the same page share most of their pairs
+    const auto terms{get_index_terms(text)};
+    if (terms.size() < 2) {
+        return {};
+    }
+
+    std::vector<std::uint32_t> signature(global::text_signature_size, std::numeric_limits<std::uint32_t>::max());
+    for (std::size_t idx{1}; idx < terms.size(); ++idx) {
+        // 64-bit FNV-1a of the pair, then one splitmix64 step per signature value
+        std::uint64_t pair_hash{0xcbf29ce484222325};
+        for (const auto c : terms[idx - 1] + ' ' + terms[idx]) {
+            pair_hash = (pair_hash ^ static_cast<std::uint8_t>(c)) * 0x100000001b3;
+        }
+
+        for (std::size_t value{}; value < signature.size(); ++value) {
+            auto hash{pair_hash + ((value + 1) * 0x9e3779b97f4a7c15)};
+            hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+            hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+            signature[value] = std::min(signature[value], static_cast<std::uint32_t>(hash ^ (hash >> 31)));
+        }
+    }
+
+    return signature;
+}
+
+double get_text_similarity(const std::vector<std::uint32_t>& lhs, const std::vector<std::uint32_t>& rhs)
+{
+    // the share of equal minimums estimates the jaccard similarity of the two sets of word pairs
+    if (lhs.empty() || (lhs.size() != rhs.size())) {
+        return 0.0;
+    }
+
+    const auto equal{std::ranges::count_if(std::views::iota(std::size_t{}, lhs.size()), [&](std::size_t idx) { return lhs[idx] == rhs[idx]; })};
+    return static_cast<double>(equal) / static_cast<double>(lhs.size());
+}
+
+std::vector<document_fingerprint> load_fingerprints(const std::filesystem::path& path)
+{
+    std::vector<document_fingerprint> fingerprints;
+
+    std::ifstream store_file(path);
+    if (!store_file) {
+        logger(hyx::logger_literals::debug, "No fingerprint store at {}\n", path.string());
+        return fingerprints;
+    }
+
+    // one 'text_signature page_hash,page_hash,... document' per line; the text signature is '-' for a page without
+    // text, and a single 16 digit value is the text hash of an older store that can never be matched again
+    const std::regex fingerprint_regex(R"(^([0-9a-f,]+|-) ([0-9a-f,]+) (.+)$)");
+    for (std::string line; std::getline(store_file, line);) {
+        std::smatch match;
+        if (!std::regex_match(line, match, fingerprint_regex)) {
+            logger(hyx::logger_literals::warning, "Bad fingerprint line \'{}\'\n", line);
+            continue;
+        }
+
+        auto& fingerprint{fingerprints.emplace_back(document_fingerprint{.document = match.str(3)})};
+        if (const auto signature{match.str(1)}; signature.size() != 16 && signature != "-") {
+            for (const auto& value : signature | std::views::split(',')) {
+                fingerprint.text_signature.push_back(static_cast<std::uint32_t>(std::stoul(std::string(value.begin(), value.end()), nullptr, 16)));
+            }
+        }
+        for (const auto& hex_hash : match.str(2) | std::views::split(',')) {
+            auto& hash{fingerprint.page_hashes.emplace_back()};
+            for (std::size_t nibble{}; const auto c : hex_hash) {
+                const auto value{(c <= '9') ? (c - '0') : (c - 'a' + 10)};
+                for (std::size_t bit{}; bit < 4 && ((nibble * 4) + bit) < hash.size(); ++bit) {
+                    hash[(nibble * 4) + bit] = ((value >> bit) & 1) != 0;
+                }
+                ++nibble;
+            }
+        }
+    }
+
+    logger(hyx::logger_literals::debug, "Loaded {} document fingerprints\n", fingerprints.size());
+    return fingerprints;
+}
+
+void save_fingerprint(const std::filesystem::path& path, const document_fingerprint& fingerprint)
+{
+    std::ofstream store_file(path, std::ios::app);
+
+    if (fingerprint.text_signature.empty()) {
+        store_file << "- ";
+    }
+    else {
+        for (auto sep{""}; const auto value : fingerprint.text_signature) {
+            store_file << sep << std::format("{:08x}", value);
+            sep = ",";
+        }
+        store_file << ' ';
+    }
+
+    for (auto sep{""}; const auto& hash : fingerprint.page_hashes) {
+        store_file << sep;
+        for (std::size_t nibble{}; nibble < (hash.size() / 4); ++nibble) {
+            const auto value{hash[nibble * 4] | (hash[(nibble * 4) + 1] << 1) | (hash[(nibble * 4) + 2] << 2) | (hash[(nibble * 4) + 3] << 3)};
+            store_file << "0123456789abcdef"[value];
+        }
+        sep = ",";
+    }
+    store_file << ' ' << fingerprint.document.string() << '\n';
+
+    if (!store_file) {
+        throw std::runtime_error("Failed to write fingerprint: \'" + path.string() + "\'");
+    }
+}
+
+const document_fingerprint* find_known_document(const std::vector<const document_fingerprint*>& candidates, const document_fingerprint& fingerprint)
+{
+    for (const auto* known : candidates) {
+        if (known->page_hashes.size() != fingerprint.page_hashes.size()) {
+            continue;
+        }
+
+        // documents on the same template look alike, so the pages only narrow it down and the text decides. two scans
+        // never read exactly the same, so the text only has to be close
+        const auto same_pages{std::ranges::equal(known->page_hashes, fingerprint.page_hashes, [](const auto& lhs, const auto& rhs) { return (lhs ^ rhs).count() <= global::duplicate_page_distance; })};
+        if (!same_pages) {
+            continue;
+        }
+
+        const auto similarity{get_text_similarity(known->text_signature, fingerprint.text_signature)};
+        logger(hyx::logger_literals::debug, "Pages match {} (text similarity {:.2f})\n", known->document.string(), similarity);
+        if (similarity >= global::known_text_similarity) {
+            return known;
+        }
+    }
+
+    return nullptr;
+}
+
+void set_job_priority(job_priority priority)
+{
+    // interactive jobs keep the priority they were started with; only bulk jobs step aside
+    if (priority == job_priority::interactive) {
+        return;
+    }
+
+    // every thread started after this (magick, tesseract, the scanning thread) inherits it
+    if (setpriority(PRIO_PROCESS, 0, global::bulk_nice) != 0) {
+        logger(hyx::logger_literals::warning, "Failed to lower the job priority: {}\n", std::strerror(errno));
+    }
+    if (const sched_param param{}; sched_setscheduler(0, SCHED_BATCH, &param) != 0) {
+        logger(hyx::logger_literals::warning, "Failed to set batch scheduling: {}\n", std::strerror(errno));
+    }
+
+#ifdef SYS_ioprio_set
+    // the idle io class only gets the disk when no one else wants it
+    constexpr auto ioprio_who_process{1};
+    constexpr auto ioprio_class_idle{3};
+    constexpr auto ioprio_class_shift{13};
+    if (syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) != 0) {
+        logger(hyx::logger_literals::warning, "Failed to set idle io priority: {}\n", std::strerror(errno));
+    }
+#endif // SYS_ioprio_set
+
+    logger(hyx::logger_literals::debug, "Running as a bulk job\n");
+}
+
+void print_help()
+{
+    std::cout << "Usage: scan2pdf [options...] file\n";
+    std::cout << '\n';
+    std::cout << "-r, --resolution     sets the resolution of the scanned image [50...600]dpi\n";
+    std::cout << "-o, --output-path    save the file to a given directory\n";
+    std::cout << "-c, --config         read settings from the given config file (once per job; SIGHUP checks a changed one)\n";
+    std::cout << "-s, --source         sets the scan source (e.g., Flatbed or \"ADF Duplex\")\n";
+    std::cout << "--archive=file       also keep the raw scanner frames in an archive for later reprocessing\n";
+    std::cout << "--reprocess=file     process the frames of an archive instead of scanning\n";
+    std::cout << "--index=dir          keep the full-text search index in the given directory\n";
+    std::cout << "--search=query       list the documents (and pages) in the index that contain every word of the query\n";
+    std::cout << "--known=skip|link    stop before OCR when the scan is a document already in the output path (link: symlink it under the new name)\n";
+    std::cout << "--text-only          only read the text and write it (and the filename fields as json) instead of a pdf\n";
+    std::cout << "--priority=bulk      only use the cpu and disk that interactive scans leave idle (e.g., for a backlog)\n";
+    std::cout << "--events-fd=fd       write progress events (page acquired, kept/removed, classified, ocr done, ...) as json lines to the given file descriptor\n";
+    std::cout << "--preview            scan a quick flatbed preview first and use it to pick the scan mode and resolution\n";
+    std::cout << "--split              split a scan of several items (e.g., receipts on a flatbed) into a page per item\n";
+    std::cout << "--calibrate=corpus   tune the page classification thresholds on a labelled corpus (corpus/{white,bw,grayscale,color}/*) and save them to the config\n";
+    std::cout << "--single-pass-ocr    detect the orientation while collecting text instead of in a separate pass\n";
+    std::cout << "--drop-duplicates    remove images that look like a duplicate of a recent image (e.g., double feeds)\n";
+}
+
+void print_version()
+{
+    std::cout << "scan2pdf " << global::version << '\n';
+    std::cout << "Copyright (C) 2022-2023 Michael Pollak\n";
+    std::cout << "License Apache-2.0: Apache License, Version 2.0 <https://www.apache.org/licenses/LICENSE-2.0>\n";
+    std::cout << '\n';
+    std::cout << "Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an \"AS IS\" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.\n";
+}
+
+std::vector<std::pair<std::string_view, double*>> get_config_values(scan2pdf_config& config)
+{
+    return {
+        {"white_percent", &config.white_percent},
+        {"bw_mean", &config.bw_mean},
+        {"bw_stddev", &config.bw_stddev},
+        {"bw_stddev_mean_diff", &config.bw_stddev_mean_diff},
+        {"grayscale_mean", &config.grayscale_mean},
+        {"grayscale_maxima", &config.grayscale_maxima},
+        {"grayscale_dpi", &config.grayscale_dpi},
+        {"color_dpi", &config.color_dpi}};
+}
+
+scan2pdf_config load_config(const std::filesystem::path& path, bool required)
+{
+    scan2pdf_config config;
+
+    std::ifstream config_file(path);
+    if (!config_file) {
+        if (required) {
+            throw std::runtime_error("Failed to read config: \'" + path.string() + "\'");
+        }
+        logger(hyx::logger_literals::debug, "No config found at {}; using defaults\n", path.string());
+        return config;
+    }
+
+    // one 'key = value' per line and anything after a '#' is a comment
+    const std::regex option_regex(R"(^\s*(\w+)\s*=\s*([^\s#]+)\s*(#.*)?$)");
+    const std::regex ignored_regex(R"(^\s*(#.*)?$)");
+    const auto config_values{get_config_values(config)};
+    for (std::string line; std::getline(config_file, line);) {
+        if (std::smatch match; std::regex_match(line, match, option_regex)) {
+            if (match.str(1) == "language") {
+                config.language = match.str(2);
+            }
+            else if (const auto value{std::ranges::find(config_values, match.str(1), [](const auto& config_value) { return config_value.first; })}; value != config_values.end()) {
+                *value->second = std::stod(match.str(2));
+            }
+            else {
+                logger(hyx::logger_literals::warning, "Unknown config option \'{}\'\n", match.str(1));
+            }
+        }
+        else if (!std::regex_match(line, ignored_regex)) {
+            logger(hyx::logger_literals::warning, "Bad config line \'{}\'\n", line);
+        }
+    }
+
+    return config;
+}
+
+void save_config(const std::filesystem::path& path, scan2pdf_config config)
+{
+    std::filesystem::create_directories(path.parent_path());
+
+    std::ofstream config_file(path);
+    config_file << "# scan2pdf " << global::version << " config\n";
+    for (const auto& [key, value] : get_config_values(config)) {
+        config_file << key << " = " << *value << '\n';
+    }
+    config_file << "language = " << config.language << '\n';
+
+    if (!config_file) {
+        throw std::runtime_error("Failed to write config: \'" + path.string() + "\'");
+    }
+}
+
+void set_device_options(hyx::sane_device* device)
+{
+    for (const auto& opt : device->get_options()) {
+        if (sane_options.contains(opt->name)) {
+            if (const auto bop{dynamic_cast<hyx::sane_device::bool_option*>(opt)}) {
+                device->set_option(bop, static_cast<SANE_Bool>(std::any_cast<bool>(sane_options.at(opt->name))));
+            }
+            else if (const auto fop{dynamic_cast<hyx::sane_device::fixed_option*>(opt)}) {
+                device->set_option(fop, std::any_cast<SANE_Fixed>(sane_options.at(opt->name)));
+            }
+            else if (const auto iop{dynamic_cast<hyx::sane_device::int_option*>(opt)}) {
+                device->set_option(iop, std::any_cast<SANE_Int>(sane_options.at(opt->name)));
+            }
+            else if (const auto sop{dynamic_cast<hyx::sane_device::string_option*>(opt)}) {
+                //! FIXME: const_cast is a bad idea (but last resort for now).
+                device->set_option(sop, const_cast<SANE_String>(std::any_cast<SANE_String_Const>(sane_options.at(opt->name))));
+            }
+        }
+    }
+}
+
+page_class get_preview_class(hyx::sane_device* device, const scan2pdf_config& config)
+{
+    logger("Scanning preview\n");
+
+    const auto scan_options{sane_options};
+    sane_options.at(SANE_NAME_SCAN_MODE) = static_cast<SANE_String_Const>(SANE_VALUE_SCAN_MODE_COLOR);
+    sane_options.at(SANE_NAME_SCAN_RESOLUTION) = global::preview_resolution;
+    set_device_options(device);
+
+    if (!device->start()) {
+        throw std::runtime_error("Failed to start the preview scan");
+    }
+    auto image{frame_to_image(get_next_frame(device, global::preview_resolution))};
+    sane_options = scan_options;
+
+    // the same features the main loop looks at after proccess() (which is quick at this size)
+    proccess(image);
+    const auto histogram{get_luma_histogram(get_luma(image))};
+    return classify_page({get_percent_white(histogram), get_solarized_gray_stats(histogram), get_saturation_stats(image)}, config);
+}
+
+page_geometry proccess(Magick::Image& image, const std::optional<page_geometry>& front_geometry)
+{
+    SCAN2PDF_PROBE(proccess_start, image.columns(), image.rows());
+
+    // basic image changes
+    image.despeckle();
+    image.enhance();
+    image.alpha(false);
+    SCAN2PDF_PROBE(proccess_enhanced, image.columns(), image.rows());
+
+    page_geometry geometry{.columns = image.columns(), .rows = image.rows()};
+
+    // both sides of a sheet share the same physical skew (mirrored on the back), so the front's deskew and edges are
+    // what the back's own should come out close to if the frames match
+    const auto use_front_geometry{front_geometry && front_geometry->columns == geometry.columns && front_geometry->rows == geometry.rows};
+
+    // the deskew threshold comes from this histogram instead of rescanning the image
+    const auto histogram{get_luma_histogram(get_luma(image))};
+
+    // a back with little on it can throw its own angle off, and then the front's is the better one
+    geometry.deskew_angle = get_deskew_angle(image, histogram);
+    if (use_front_geometry && (std::abs(geometry.deskew_angle + front_geometry->deskew_angle) > global::back_side_angle_tolerance)) {
+        logger(hyx::logger_literals::debug, "Back side angle {} is off from the front side: using {}\n", geometry.deskew_angle, -front_geometry->deskew_angle);
+        geometry.deskew_angle = -front_geometry->deskew_angle;
+    }
+    deskew(image, geometry.deskew_angle);
+    image.repage();
+    geometry.deskewed_columns = image.columns();
+    geometry.deskewed_rows = image.rows();
+    SCAN2PDF_PROBE(proccess_deskewed, image.columns(), image.rows());
+
+    // crop the scan edges of the image (the same way the angle gets refined on a back)
+    geometry.trim_edges = get_trim_edges_bounds(image);
+    if (use_front_geometry) {
+        auto front_edges{front_geometry->trim_edges};
+        front_edges.xOff(static_cast<::ssize_t>(geometry.deskewed_columns - front_edges.width()) - front_edges.xOff());
+
+        const auto tolerance{static_cast<double>(std::max(geometry.deskewed_columns, geometry.deskewed_rows)) * global::back_side_edge_tolerance};
+        const auto is_off{[tolerance](auto lhs, auto rhs) { return std::abs(static_cast<double>(lhs) - static_cast<double>(rhs)) > tolerance; }};
+        const auto& edges{geometry.trim_edges};
+        if (is_off(edges.xOff(), front_edges.xOff()) || is_off(edges.yOff(), front_edges.yOff()) || is_off(edges.width(), front_edges.width()) || is_off(edges.height(), front_edges.height())) {
+            logger(hyx::logger_literals::debug, "Back side edges are off from the front side: using the front side edges\n");
+            geometry.trim_edges = front_edges;
+        }
+    }
+    image.crop(geometry.trim_edges);
+    image.repage();
+    SCAN2PDF_PROBE(proccess_trimmed_edges, image.columns(), image.rows());
+
+    // remove the shadow on the top of the image; the scanner background that was just cropped away would skew the
+    // threshold, so the histogram is taken again from the page alone
+    image.crop(get_trim_shadow_bounds(image, get_luma_histogram(get_luma(image))));
+    image.repage();
+
+    image.gamma(global::scanner_gamma_fix);
+    SCAN2PDF_PROBE(proccess_end, image.columns(), image.rows());
+
+    return geometry;
+}
+
+bool is_blank_back_side(Magick::Image image, const page_geometry& front_geometry, const scan2pdf_config& config)
+{
+    // most backs are empty, so we check a proxy of where the front found the page before doing any real work
+    if (front_geometry.columns != image.columns() || front_geometry.rows != image.rows()) {
+        return false;
+    }
+
+    logger(hyx::logger_literals::debug, "Checking for a blank back side\n");
+
+    // the rotation was around the center, so the (mirrored) front edges only need to be shifted back into the frame.
+    // the back is not deskewed yet, so its edges can be off by as much as the skew moves them; past that only a
+    // sliver is left out for the edge shadow so content near the edges (page numbers, signatures, notes) still counts
+    const auto& trim_edges{front_geometry.trim_edges};
+    const auto skew{std::abs(std::sin(front_geometry.deskew_angle * std::numbers::pi / 180.0))};
+    const auto width{static_cast<double>(trim_edges.width())};
+    const auto height{static_cast<double>(trim_edges.height())};
+    const auto margin_columns{static_cast<::ssize_t>(std::ceil((height * skew) + (width * global::blank_back_margin)))};
+    const auto margin_rows{static_cast<::ssize_t>(std::ceil((width * skew) + (height * global::blank_back_margin)))};
+    const auto x_shift{static_cast<::ssize_t>(front_geometry.deskewed_columns - front_geometry.columns) / 2};
+    const auto y_shift{static_cast<::ssize_t>(front_geometry.deskewed_rows - front_geometry.rows) / 2};
+
+    const auto x_offset{std::max<::ssize_t>(static_cast<::ssize_t>(front_geometry.deskewed_columns - trim_edges.width()) - trim_edges.xOff() - x_shift + margin_columns, 0)};
+    const auto y_offset{std::max<::ssize_t>(trim_edges.yOff() - y_shift + margin_rows, 0)};
+    const auto columns{std::min<::ssize_t>(static_cast<::ssize_t>(trim_edges.width()) - (2 * margin_columns), static_cast<::ssize_t>(image.columns()) - x_offset)};
+    const auto rows{std::min<::ssize_t>(static_cast<::ssize_t>(trim_edges.height()) - (2 * margin_rows), static_cast<::ssize_t>(image.rows()) - y_offset)};
+    if (columns <= 0 || rows <= 0) {
+        return false;
+    }
+
+    image.crop(Magick::Geometry(static_cast<std::size_t>(columns), static_cast<std::size_t>(rows), x_offset, y_offset));
+    image.resize("25%");
+
+    // the pipeline checks for white after the gamma fix, so we apply it to the histogram
+    return is_white(get_percent_white(gamma_luma_histogram(get_luma_histogram(get_luma(image)), global::scanner_gamma_fix)), config);
+}
+
+double get_deskew_angle(Magick::Image image, const luma_histogram& histogram)
+{
+    logger(hyx::logger_literals::debug, "Getting deskew angle\n");
+
+    // reducing the image size will greatly improve deskew time and accuracy due to less pixels and 'fuzzing'
+    image.resize("10%");
+    image.threshold(luma_to_quantum(get_otsu_threshold(histogram)));
+    image.deskew(80_quantum_percent);
+
+    // note: negative since the image got flipped
+    return std::stod(image.artifact("deskew:angle"));
+}
+
+void deskew(Magick::Image& image, double deskew_angle)
+{
+    logger("Deskewing image\n");
+
+    // Find the color of the scan background.
+    const auto background_color{image.pixelColor(5, 5)};
+    image.backgroundColor(background_color);
+    logger(hyx::logger_literals::debug, "Set background color to ({},{},{})\n", quantum_as_rgb(background_color.quantumRed()), quantum_as_rgb(background_color.quantumGreen()), quantum_as_rgb(background_color.quantumBlue()));
+
+    image.rotate(deskew_angle);
+    logger(hyx::logger_literals::debug, "Deskewed by {} degrees\n", deskew_angle);
+
+    dump_image(image, "deskewed");
+}
+
+std::string get_trim_edges_bounds(Magick::Image image)
+{
+    // magick in.png -fuzz 10% -set MBB '%[minimum-bounding-box]' -fill black -colorize 100 -fill white -draw "polygon %[MBB]" -define trim:percent-background=0 -trim -format "%wx%h%X%Y" info:
+
+    logger("Trimming edges\n");
+
+    // the colorFuzz value will influence the MBR
+    image.colorFuzz(10_quantum_percent);
+    // MBR = Minimum Bounding Rectangle
+    auto mbr{image.formatExpression("%[minimum-bounding-box]")};
+
+    // create our polygon coordinates
+    std::vector<Magick::Coordinate> mbr_coords;
+    for (const auto& coord : mbr | std::views::split(' ')) {
+        for (const auto& [x, y] : coord | std::views::split(',') | std::views::pairwise) {
+            mbr_coords.emplace_back(std::stod(std::string(x.begin(), x.end())), std::stod(std::string(y.begin(), y.end())));
+        }
+    }
+
+    // create a black background and white box over the MBR so we can easily trim to it.
+    constexpr auto colorize_alpha{100u};
+    image.colorize(colorize_alpha, "black");
+    image.fillColor("white");
+    image.draw(Magick::DrawablePolygon(mbr_coords));
+    image.artifact("trim:percent-background", "0");
+
+    dump_image(image, "trim_edges_before_trim");
+
+    image.trim();
+
+    dump_image(image, "trim_edges");
+
+    return image.formatExpression("%wx%h%X%Y");
+}
+
+std::vector<Magick::Image> split_items(const Magick::Image& image)
+{
+    logger("Splitting items\n");
+
+    // find the items on a small proxy where everything that is not the bed is foreground
+    Magick::Image proxy{image};
+    proxy.resize("10%");
+    const auto scale{static_cast<double>(image.columns()) / static_cast<double>(proxy.columns())};
+
+    hyx::unique_pix pgray{pixConvertTo8(hyx::unique_pix(magick2pix(proxy)).get(), 0)};
+
+    // the bed shows in the corner (same as in deskew())
+    constexpr l_int32 background_fuzz{30};
+    constexpr l_int32 gray_max{255};
+    l_uint32 background{};
+    pixGetPixel(pgray.get(), 5, 5, &background);
+    const auto background_gray{static_cast<l_int32>(background)};
+    hyx::unique_pix pbackground{pixGenerateMaskByBand(pgray.get(), std::max(background_gray - background_fuzz, 0), std::min(background_gray + background_fuzz, gray_max), 1, 0)};
+    hyx::unique_pix pforeground{pixInvert(nullptr, pbackground.get())};
+
+    // close the gaps between the lines of an item so each item is one component
+    constexpr l_int32 close_size{7};
+    hyx::unique_pix pitems{pixCloseBrick(nullptr, pforeground.get(), close_size, close_size)};
+
+    const std::unique_ptr<BOXA, decltype([](BOXA* boxa) { boxaDestroy(&boxa); })> boxes{pixConnComp(pitems.get(), nullptr, 8)};
+
+    // ignore dust and specks, and keep some bed around each item so the edge trim can still find it
+    const auto min_area{static_cast<l_int32>((proxy.columns() * proxy.rows()) / 100)};
+    constexpr l_int32 padding{2};
+
+    std::vector<Magick::Image> items;
+    for (l_int32 idx{}; idx < boxaGetCount(boxes.get()); ++idx) {
+        l_int32 x{};
+        l_int32 y{};
+        l_int32 width{};
+        l_int32 height{};
+        boxaGetBoxGeometry(boxes.get(), idx, &x, &y, &width, &height);
+        if ((width * height) < min_area) {
+            continue;
+        }
+
+        const auto left{static_cast<::ssize_t>(std::max(x - padding, 0) * scale)};
+        const auto top{static_cast<::ssize_t>(std::max(y - padding, 0) * scale)};
+        const auto right{std::min(static_cast<::ssize_t>((x + width + padding) * scale), static_cast<::ssize_t>(image.columns()))};
+        const auto bottom{std::min(static_cast<::ssize_t>((y + height + padding) * scale), static_cast<::ssize_t>(image.rows()))};
+
+        auto& item{items.emplace_back(image)};
+        item.crop(Magick::Geometry(static_cast<std::size_t>(right - left), static_cast<std::size_t>(bottom - top), left, top));
+        item.repage();
+    }
+
+    logger(hyx::logger_literals::debug, "Found {} items\n", items.size());
+
+    // we could not tell the items from the bed (e.g., white items on a white lid), so keep the whole scan
+    if (items.empty()) {
+        items.push_back(image);
+    }
+
+    return items;
+}
+
+void proccess_items(std::vector<Magick::Image>& items)
+{
+    // each item gets its own deskew and crop on its own thread
+    std::vector<std::exception_ptr> errors(items.size());
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t idx{}; idx < items.size(); ++idx) {
+            workers.emplace_back([&items, &errors, idx]() {
+                try {
+                    proccess(items[idx]);
+                }
+                catch (...) {
+                    errors[idx] = std::current_exception();
+                }
+            });
+        }
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+std::string get_trim_shadow_bounds(Magick::Image image, const luma_histogram& histogram)
+{
+    logger("Trimming shadow\n");
+
+    image.gamma(global::scanner_gamma_fix);
+    constexpr auto blur_radius{0.0};
+    constexpr auto blur_sigma{5.0};
+    image.adaptiveBlur(blur_radius, blur_sigma);
+    // the blur barely moves the otsu threshold so the gamma corrected histogram is close enough
+    image.threshold(luma_to_quantum(get_otsu_threshold(gamma_luma_histogram(histogram, global::scanner_gamma_fix))));
+    image.artifact("trim:percent-background", "5");
+    image.artifact("trim:background-color", "black");
+
+    dump_image(image, "trim_shadow_before_trim");
 
     auto image_canvas{image.formatExpression("%wx%h%X%Y")};
     logger(hyx::logger_literals::debug, "Starting dimentions: {}\n", image_canvas);
@@ -339,176 +2002,1303 @@ std::string get_trim_shadow_bounds(Magick::Image image)
             image.trim();
             const auto after_trim_image_canvas = image.formatExpression("%wx%h%X%Y");
 
-            // check to see if the trim removed anything
-            logger(hyx::logger_literals::debug, "After trim dimentions: {}\n", after_trim_image_canvas);
-            if (before_trim_image_canvas == after_trim_image_canvas) {
-                // maybe the shadow is not at the edge of the image?
-                // we will try to dig one pixel at a time to find the shadow
-                logger(hyx::logger_literals::debug, "Removing pixel line to find shadow\n");
-                image.crop("+0-1");
-                image.repage();
+            // check to see if the trim removed anything
+            logger(hyx::logger_literals::debug, "After trim dimentions: {}\n", after_trim_image_canvas);
+            if (before_trim_image_canvas == after_trim_image_canvas) {
+                // maybe the shadow is not at the edge of the image?
+                // we will try to dig one pixel at a time to find the shadow
+                logger(hyx::logger_literals::debug, "Removing pixel line to find shadow\n");
+                image.crop("+0-1");
+                image.repage();
+            }
+            else {
+                image_canvas = after_trim_image_canvas;
+                break;
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        logger(hyx::logger_literals::warning, "Failed to trim shadow: {}\n", e.what());
+    }
+
+    dump_image(image, "trim_shadow_after_trim");
+
+    return image_canvas;
+}
+
+luma_image get_luma(Magick::Image image)
+{
+    luma_image luma{image.columns(), image.rows(), std::vector<std::uint8_t>(image.columns() * image.rows())};
+    image.write(0, 0, luma.width, luma.height, "I", Magick::CharPixel, luma.pixels.data());
+    return luma;
+}
+
+luma_histogram get_luma_histogram(const luma_image& luma)
+{
+    luma_histogram histogram{};
+    for (const auto value : luma.pixels) {
+        ++histogram.counts[value];
+    }
+    histogram.total = luma.pixels.size();
+
+    return histogram;
+}
+
+luma_histogram gamma_luma_histogram(const luma_histogram& histogram, double gamma)
+{
+    // a tone curve only moves whole bins so we never need to go back to the pixels
+    constexpr auto luma_max{255.0};
+
+    luma_histogram mapped{};
+    for (std::size_t value{}; value < histogram.counts.size(); ++value) {
+        const auto mapped_value{std::lround(std::pow(static_cast<double>(value) / luma_max, 1.0 / gamma) * luma_max)};
+        mapped.counts[static_cast<std::size_t>(mapped_value)] += histogram.counts[value];
+    }
+    mapped.total = histogram.total;
+
+    return mapped;
+}
+
+std::uint8_t get_otsu_threshold(const luma_histogram& histogram)
+{
+    double total_sum{};
+    for (std::size_t value{}; value < histogram.counts.size(); ++value) {
+        total_sum += static_cast<double>(value * histogram.counts[value]);
+    }
+
+    // find the split that maximizes the variance between the dark and light classes
+    std::uint8_t threshold{};
+    double max_variance{};
+    double dark_sum{};
+    std::size_t dark_count{};
+    for (std::size_t value{}; value < histogram.counts.size(); ++value) {
+        dark_count += histogram.counts[value];
+        dark_sum += static_cast<double>(value * histogram.counts[value]);
+        if (dark_count == 0) {
+            continue;
+        }
+
+        const auto light_count{histogram.total - dark_count};
+        if (light_count == 0) {
+            break;
+        }
+
+        const auto mean_diff{(dark_sum / dark_count) - ((total_sum - dark_sum) / light_count)};
+        if (const auto variance{static_cast<double>(dark_count) * static_cast<double>(light_count) * mean_diff * mean_diff}; variance > max_variance) {
+            max_variance = variance;
+            threshold = static_cast<std::uint8_t>(value);
+        }
+    }
+
+    return threshold;
+}
+
+void set_luma(Magick::Image& image, const luma_image& luma, Magick::ImageType type)
+{
+    // reading raw pixels replaces the image so we need to carry over the output settings
+    const auto density{image.density()};
+    const auto compress_type{image.compressType()};
+
+    image.read(luma.width, luma.height, "I", Magick::CharPixel, luma.pixels.data());
+    image.density(density);
+    image.compressType(compress_type);
+    image.type(type);
+}
+
+template <typename Function>
+void for_each_band(std::size_t height, Function&& func)
+{
+    std::atomic<std::size_t> next_band{0};
+    const auto thread_count{std::max(1u, std::thread::hardware_concurrency())};
+
+    // each worker takes the next band of rows until there are none left
+    std::vector<std::jthread> workers;
+    for ([[maybe_unused]] auto _ : std::views::iota(0u, thread_count)) {
+        workers.emplace_back([&next_band, &func, height]() {
+            for (auto y_begin{next_band.fetch_add(global::threshold_band_height)}; y_begin < height; y_begin = next_band.fetch_add(global::threshold_band_height)) {
+                func(y_begin, std::min(height, y_begin + global::threshold_band_height));
+            }
+        });
+    }
+}
+
+/**
+ * @brief Calls func(x, y, mean, stddev) with the window statistics of every pixel in rows [y_begin, y_end).
+ * The integral images only cover the band and its window overlap so the memory stays bounded by the band size.
+ */
+template <typename Function>
+void for_each_window_stats(const luma_image& luma, std::size_t y_begin, std::size_t y_end, std::size_t radius, Function&& func)
+{
+    const auto width{luma.width};
+    const auto stride{width + 1};
+    const auto top{y_begin - std::min(y_begin, radius)};
+    const auto bottom{std::min(luma.height, y_end + radius)};
+
+    // the first row and column stay zero so we never need to special case the window edges
+    std::vector<std::int64_t> sums(stride * (bottom - top + 1));
+    std::vector<std::int64_t> squares(stride * (bottom - top + 1));
+    std::vector<std::int64_t> row_sums(stride);
+    std::vector<std::int64_t> row_squares(stride);
+
+    for (auto y{top}; y < bottom; ++y) {
+        const auto* row{luma.pixels.data() + (y * width)};
+        for (std::size_t x{}; x < width; ++x) {
+            const std::int64_t value{row[x]};
+            row_sums[x + 1] = row_sums[x] + value;
+            row_squares[x + 1] = row_squares[x] + (value * value);
+        }
+
+        // the prefix sum above is serial, but adding the row above is not and gets vectorized
+        const auto* prev_sums{sums.data() + ((y - top) * stride)};
+        const auto* prev_squares{squares.data() + ((y - top) * stride)};
+        auto* curr_sums{sums.data() + ((y - top + 1) * stride)};
+        auto* curr_squares{squares.data() + ((y - top + 1) * stride)};
+        for (std::size_t x{}; x < stride; ++x) {
+            curr_sums[x] = prev_sums[x] + row_sums[x];
+            curr_squares[x] = prev_squares[x] + row_squares[x];
+        }
+    }
+
+    const auto window_value{[stride](const std::vector<std::int64_t>& integral, std::size_t x0, std::size_t y0, std::size_t x1, std::size_t y1) {
+        return static_cast<double>(integral[(y1 * stride) + x1] - integral[(y0 * stride) + x1] - integral[(y1 * stride) + x0] + integral[(y0 * stride) + x0]);
+    }};
+
+    for (auto y{y_begin}; y < y_end; ++y) {
+        const auto y0{y - std::min(y, radius) - top};
+        const auto y1{std::min(bottom, y + radius + 1) - top};
+        for (std::size_t x{}; x < width; ++x) {
+            const auto x0{x - std::min(x, radius)};
+            const auto x1{std::min(width, x + radius + 1)};
+            const auto area{static_cast<double>((x1 - x0) * (y1 - y0))};
+
+            const auto mean{window_value(sums, x0, y0, x1, y1) / area};
+            const auto variance{(window_value(squares, x0, y0, x1, y1) / area) - (mean * mean)};
+            func(x, y, mean, std::sqrt(std::max(variance, 0.0)));
+        }
+    }
+}
+
+luma_image adaptive_threshold(const luma_image& luma, threshold_method method, const luma_histogram& histogram)
+{
+    constexpr std::size_t window_radius{25};
+    constexpr std::uint8_t black{0};
+    constexpr std::uint8_t white{255};
+
+    luma_image bilevel{luma.width, luma.height, std::vector<std::uint8_t>(luma.pixels.size())};
+    const auto set_pixel{[&luma, &bilevel](std::size_t x, std::size_t y, double threshold) {
+        const auto idx{(y * luma.width) + x};
+        bilevel.pixels[idx] = (luma.pixels[idx] > threshold) ? white : black;
+    }};
+
+    if (method == threshold_method::sauvola) {
+        constexpr auto sauvola_k{0.34};
+        constexpr auto sauvola_range{128.0};
+
+        for_each_band(luma.height, [&](std::size_t y_begin, std::size_t y_end) {
+            for_each_window_stats(luma, y_begin, y_end, window_radius, [&](std::size_t x, std::size_t y, double mean, double stddev) {
+                set_pixel(x, y, mean * (1.0 + (sauvola_k * ((stddev / sauvola_range) - 1.0))));
+            });
+        });
+    }
+    else {
+        constexpr auto wolf_k{0.5};
+
+        // wolf normalizes by the global minimum and the largest window deviation, so we need a first pass to find them
+        const auto min_gray{static_cast<double>(std::ranges::distance(histogram.counts.begin(), std::ranges::find_if(histogram.counts, [](auto count) { return count != 0; })))};
+        std::vector<double> band_max_stddevs((luma.height + global::threshold_band_height - 1) / global::threshold_band_height);
+        for_each_band(luma.height, [&](std::size_t y_begin, std::size_t y_end) {
+            auto& band_max_stddev{band_max_stddevs[y_begin / global::threshold_band_height]};
+            for_each_window_stats(luma, y_begin, y_end, window_radius, [&band_max_stddev]([[maybe_unused]] std::size_t x, [[maybe_unused]] std::size_t y, [[maybe_unused]] double mean, double stddev) {
+                band_max_stddev = std::max(band_max_stddev, stddev);
+            });
+        });
+        const auto max_stddev{std::max(*std::ranges::max_element(band_max_stddevs), 1.0)};
+
+        for_each_band(luma.height, [&](std::size_t y_begin, std::size_t y_end) {
+            for_each_window_stats(luma, y_begin, y_end, window_radius, [&](std::size_t x, std::size_t y, double mean, double stddev) {
+                set_pixel(x, y, mean - (wolf_k * (1.0 - (stddev / max_stddev)) * (mean - min_gray)));
+            });
+        });
+    }
+
+    return bilevel;
+}
+
+luma_image transform_to_bw(Magick::Image& image, const luma_image& luma, const luma_histogram& histogram)
+{
+    logger(hyx::logger_literals::debug, "Converting to black and white\n");
+
+    // wolf handles the low contrast of pages without text better than a global threshold
+    auto bilevel{adaptive_threshold(luma, threshold_method::wolf, histogram)};
+    set_luma(image, bilevel, Magick::BilevelType);
+
+    return bilevel;
+}
+
+luma_image transform_with_text_to_bw(Magick::Image& image, const luma_image& luma, const luma_histogram& histogram)
+{
+    logger(hyx::logger_literals::debug, "Converting to black and white\n");
+
+    // sauvola adapts to uneven lighting (e.g., curled receipts) without needing to level or sharpen first
+    auto bilevel{adaptive_threshold(luma, threshold_method::sauvola, histogram)};
+    set_luma(image, bilevel, Magick::BilevelType);
+
+    return bilevel;
+}
+
+void transform_to_grayscale(Magick::Image& image)
+{
+    logger(hyx::logger_literals::debug, "Converting to greyscale\n");
+
+    // magick in.png -brightness-contrast 0x30 -colorspace LinearGray out.png
+
+    // the contrast and the linearization are both per channel curves, so we fold them (and the luma weights) into
+    // one table per channel and convert the whole page in a single pass.
+    constexpr auto brightness{0.0};
+    constexpr auto contrast{30.0};
+    constexpr auto luma_max{255.0};
+    constexpr std::array luma_weights{0.212656, 0.715158, 0.072186};
+
+    // same slope and intercept as MagickCore's BrightnessContrastImage()
+    const auto slope{std::max(std::tan(std::numbers::pi * ((contrast / 100.0) + 1.0) / 4.0), 0.0)};
+    const auto intercept{(brightness / 100.0) + (((100.0 - brightness) / 200.0) * (1.0 - slope))};
+
+    std::array<std::array<double, 256>, luma_weights.size()> channel_tables{};
+    for (std::size_t value{}; value < channel_tables.front().size(); ++value) {
+        const auto contrasted{std::clamp((slope * (static_cast<double>(value) / luma_max)) + intercept, 0.0, 1.0)};
+        const auto linear{(contrasted <= 0.04045) ? contrasted / 12.92 : std::pow((contrasted + 0.055) / 1.055, 2.4)};
+        for (std::size_t channel{}; channel < luma_weights.size(); ++channel) {
+            channel_tables[channel][value] = luma_weights[channel] * linear * luma_max;
+        }
+    }
+
+    const auto width{image.columns()};
+    const auto height{image.rows()};
+    std::vector<std::uint8_t> rgb(width * height * luma_weights.size());
+    image.write(0, 0, width, height, "RGB", Magick::CharPixel, rgb.data());
+
+    luma_image gray{width, height, std::vector<std::uint8_t>(width * height)};
+    for (std::size_t idx{}; idx < gray.pixels.size(); ++idx) {
+        const auto* pixel{rgb.data() + (idx * luma_weights.size())};
+        gray.pixels[idx] = static_cast<std::uint8_t>(std::lround(channel_tables[0][pixel[0]] + channel_tables[1][pixel[1]] + channel_tables[2][pixel[2]]));
+    }
+
+    set_luma(image, gray, Magick::GrayscaleType);
+    image.depth(8);
+}
+
+void transform_to_palette(Magick::Image& image, std::size_t colors)
+{
+    logger(hyx::logger_literals::debug, "Converting to a palette of {} colors\n", colors);
+
+    // magick in.png +dither -colors 4 -type palette out.png
+
+    // no dithering so the spot colors stay flat (which also keeps the flate encoding small)
+    image.quantizeColors(colors);
+    image.quantizeDither(false);
+    image.quantize();
+    image.type(Magick::PaletteType);
+}
+
+saturation_stats get_saturation_stats(Magick::Image image)
+{
+    // magick in.png -colorspace HSB -resize 2% -format "%[fx:mean.g] %[fx:maxima.g]\n" info:-
+
+    image.colorSpace(Magick::HSBColorspace);
+    image.resize("2%");
+
+    const auto image_saturation_stats{image.statistics().channel(Magick::PixelChannel::GreenPixelChannel)};
+    const saturation_stats stats{quantum_to_percent(image_saturation_stats.mean()), quantum_to_percent(image_saturation_stats.maxima())};
+
+    logger(hyx::logger_literals::debug, "Saturation mean: {}%\n", stats.mean);
+    logger(hyx::logger_literals::debug, "Saturation maxima: {}%\n", stats.maxima);
+
+    return stats;
+}
+
+bool is_grayscale(const saturation_stats& stats, const scan2pdf_config& config)
+{
+    // constinit static const auto log_prefix{"Grayscale Check"};
+
+    // if we have small mean saturation and no large spike (maxima) of saturation anywhere, image is grayscale
+    if (stats.mean < config.grayscale_mean && stats.maxima < config.grayscale_maxima) {
+        return true;
+    }
+
+    // if we have high mean, image is not grayscale
+    // if we have high maxima, image contains some significant color (e.g., logo)
+    return false;
+}
+
+std::size_t get_palette_colors(Magick::Image image)
+{
+    // magick in.png -resize 25% +dither -colors 4 -verbose info: (and look at the normalized mean error)
+
+    // pages with only a few spot colors (e.g., a red stamp or a blue logo) lose nothing with a small palette
+    constexpr std::array<std::size_t, 2> palette_sizes{4, 16};
+    constexpr auto mean_error_threshold{0.02};
+
+    image.resize("25%");
+
+    for (const auto colors : palette_sizes) {
+        auto quantized_image{image};
+        quantized_image.quantizeColors(colors);
+        quantized_image.quantizeDither(false);
+        quantized_image.quantize(true);
+
+        const auto mean_error{quantized_image.normalizedMeanError()};
+        logger(hyx::logger_literals::debug, "Palette of {} colors has mean error: {}\n", colors, mean_error);
+
+        if (mean_error < mean_error_threshold) {
+            return colors;
+        }
+    }
+
+    // too many colors for a palette
+    return 0;
+}
+
+gray_stats get_solarized_gray_stats(const luma_histogram& histogram)
+{
+    // magick in.png -solarize 50% -colorspace gray -identify -verbose info:
+
+    // solarizing folds the histogram at the middle, so the statistics come straight from the bins
+    constexpr auto luma_max{255.0};
+    double solarized_sum{};
+    double solarized_square_sum{};
+    for (std::size_t value{}; value < histogram.counts.size(); ++value) {
+        const auto solarized{(static_cast<double>(value) > (luma_max / 2)) ? luma_max - static_cast<double>(value) : static_cast<double>(value)};
+        solarized_sum += solarized * static_cast<double>(histogram.counts[value]);
+        solarized_square_sum += solarized * solarized * static_cast<double>(histogram.counts[value]);
+    }
+    const auto solarized_mean{solarized_sum / static_cast<double>(histogram.total)};
+    const auto solarized_variance{(solarized_square_sum / static_cast<double>(histogram.total)) - (solarized_mean * solarized_mean)};
+
+    const gray_stats stats{quantum_to_percent(luma_to_quantum(solarized_mean)), quantum_to_percent(luma_to_quantum(std::sqrt(std::max(solarized_variance, 0.0))))};
+
+    logger(hyx::logger_literals::debug, "Gray mean: {}\n", stats.mean);
+    logger(hyx::logger_literals::debug, "Gray standard deviation: {}\n", stats.stddev);
+
+    return stats;
+}
+
+bool is_bw(const gray_stats& stats, const scan2pdf_config& config)
+{
+    // constinit static const auto log_prefix{"BW Check"};
+
+    // if we have close to zero mean and small, but larger than mean, deviation, image is bw
+    // (we will allow a small padding for close deviation and mean difference to prefer bw over other options when it's unclear)
+    if (stats.mean < config.bw_mean && stats.stddev < config.bw_stddev && (stats.stddev - stats.mean) > config.bw_stddev_mean_diff) {
+        return true;
+    }
+
+    // if we have any other case, image is not bw
+    return false;
+}
+
+double get_percent_white(const luma_histogram& histogram)
+{
+    // magick in.png -white-threshold 75% -format "%[fx:mean]" info:
+
+    // pixels above the threshold count as fully white and the rest count as their own value
+    constexpr auto luma_max{255.0};
+    constexpr auto white_threshold{0.75 * luma_max};
+    double white_sum{};
+    for (std::size_t value{}; value < histogram.counts.size(); ++value) {
+        white_sum += static_cast<double>(histogram.counts[value]) * ((static_cast<double>(value) > white_threshold) ? 1.0 : static_cast<double>(value) / luma_max);
+    }
+    const auto percent_white{white_sum / static_cast<double>(histogram.total)};
+
+    logger(hyx::logger_literals::debug, "Percent white: {}\n", percent_white);
+
+    return percent_white;
+}
+
+bool is_white(double percent_white, const scan2pdf_config& config)
+{
+    // constinit static const auto log_prefix{"All White Check"};
+
+    if (percent_white > config.white_percent) {
+        return true;
+    }
+
+    return false;
+}
+
+page_hash get_page_hash(const luma_image& luma)
+{
+    // magick in.png -colorspace gray -resize 17x16! out.png (then compare each cell to its right neighbour)
+
+    constexpr std::size_t grid_width{17};
+    constexpr std::size_t grid_height{16};
+
+    // average the page down to the grid in one pass over the luma we already have
+    std::vector<std::size_t> cell_columns(luma.width);
+    for (std::size_t x{}; x < luma.width; ++x) {
+        cell_columns[x] = (x * grid_width) / luma.width;
+    }
+
+    std::array<std::uint64_t, grid_width * grid_height> cell_sums{};
+    std::array<std::uint64_t, grid_width * grid_height> cell_counts{};
+    for (std::size_t y{}; y < luma.height; ++y) {
+        const auto* row{luma.pixels.data() + (y * luma.width)};
+        const auto cell_row{((y * grid_height) / luma.height) * grid_width};
+        for (std::size_t x{}; x < luma.width; ++x) {
+            cell_sums[cell_row + cell_columns[x]] += row[x];
+            ++cell_counts[cell_row + cell_columns[x]];
+        }
+    }
+
+    const auto cell_mean{[&cell_sums, &cell_counts](std::size_t idx) {
+        return static_cast<double>(cell_sums[idx]) / static_cast<double>(std::max<std::uint64_t>(cell_counts[idx], 1));
+    }};
+
+    page_hash hash;
+    for (std::size_t y{}; y < grid_height; ++y) {
+        for (std::size_t x{}; x < (grid_width - 1); ++x) {
+            hash[(y * (grid_width - 1)) + x] = cell_mean((y * grid_width) + x) < cell_mean((y * grid_width) + x + 1);
+        }
+    }
+
+    return hash;
+}
+
+bool is_duplicate_page(const page_hash& hash, std::deque<page_hash>& recent_hashes)
+{
+    // double feeds show up right away, but a re-fed sheet can come a few pages later
+    constexpr std::size_t max_recent_hashes{8};
+
+    auto min_distance{hash.size()};
+    for (const auto& recent_hash : recent_hashes) {
+        min_distance = std::min(min_distance, (recent_hash ^ hash).count());
+    }
+
+    recent_hashes.push_back(hash);
+    if (recent_hashes.size() > max_recent_hashes) {
+        recent_hashes.pop_front();
+    }
+
+    logger(hyx::logger_literals::debug, "Closest recent page hash distance: {}\n", min_distance);
+
+    if (min_distance <= global::duplicate_page_distance) {
+        logger(hyx::logger_literals::warning, "Image looks like a duplicate of a recent image\n");
+        return true;
+    }
+
+    return false;
+}
+
+PIX* magick2pix(Magick::Image& image)
+{
+    Magick::Blob bimage;
+    image.write(&bimage, "tiff");
+    auto* pimage{pixReadMemTiff(static_cast<const unsigned char*>(bimage.data()), bimage.length(), 0)};
+    if (!pimage) {
+        throw std::runtime_error("Failed to convert image to a leptonica pix");
+    }
+
+    return pimage;
+}
+
+PIX* bilevel2pix(const luma_image& bilevel, int resolution)
+{
+    // tesseract only thresholds images that are not already 1-bpp, so we build one ourselves instead of going through a tiff
+    auto* pimage{pixCreate(static_cast<l_int32>(bilevel.width), static_cast<l_int32>(bilevel.height), 1)};
+    if (!pimage) {
+        throw std::runtime_error("Failed to create a " + std::to_string(bilevel.width) + "x" + std::to_string(bilevel.height) + " bilevel pix");
+    }
+    pixSetResolution(pimage, resolution, resolution);
+
+    auto* data{pixGetData(pimage)};
+    const auto wpl{static_cast<std::size_t>(pixGetWpl(pimage))};
+    for (std::size_t y{}; y < bilevel.height; ++y) {
+        auto* line{data + (y * wpl)};
+        const auto* row{bilevel.pixels.data() + (y * bilevel.width)};
+        for (std::size_t x{}; x < bilevel.width; ++x) {
+            // leptonica uses 1 for black
+            if (row[x] == 0) {
+                SET_DATA_BIT(line, x);
             }
-            else {
-                image_canvas = after_trim_image_canvas;
-                break;
+        }
+    }
+
+    return pimage;
+}
+
+page_class classify_page(const page_features& features, const scan2pdf_config& config)
+{
+    // same order as the main loop
+    if (is_white(features.percent_white, config)) {
+        return page_class::white;
+    }
+    if (is_bw(features.gray, config)) {
+        return page_class::bw;
+    }
+    if (is_grayscale(features.saturation, config)) {
+        return page_class::grayscale;
+    }
+
+    return page_class::color;
+}
+
+std::array<std::array<std::size_t, 4>, 4> get_confusion_matrix(const std::vector<std::pair<page_class, page_features>>& samples, const scan2pdf_config& config)
+{
+    // rows are the labelled class and columns are the classified class
+    std::array<std::array<std::size_t, 4>, 4> confusion_matrix{};
+    for (const auto& [label, features] : samples) {
+        ++confusion_matrix[static_cast<std::size_t>(label)][static_cast<std::size_t>(classify_page(features, config))];
+    }
+
+    return confusion_matrix;
+}
+
+double get_misclassification_cost(const std::vector<std::pair<page_class, page_features>>& samples, const scan2pdf_config& config)
+{
+    // rows are the labelled class and columns are the classified class.
+    // removing a page or losing its color is much worse than taking a slower (but safe) path.
+    constexpr std::array<std::array<double, 4>, 4> misclassification_costs{{
+        {0.0, 1.0, 1.0, 1.0},
+        {20.0, 0.0, 1.0, 2.0},
+        {20.0, 5.0, 0.0, 1.0},
+        {20.0, 10.0, 10.0, 0.0},
+    }};
+
+    const auto confusion_matrix{get_confusion_matrix(samples, config)};
+
+    double cost{};
+    for (std::size_t label{}; label < confusion_matrix.size(); ++label) {
+        for (std::size_t classified{}; classified < confusion_matrix[label].size(); ++classified) {
+            cost += misclassification_costs[label][classified] * static_cast<double>(confusion_matrix[label][classified]);
+        }
+    }
+
+    return cost;
+}
+
+void print_confusion_matrix(const std::array<std::array<std::size_t, 4>, 4>& confusion_matrix)
+{
+    constexpr std::array<std::string_view, 4> page_class_names{"white", "bw", "grayscale", "color"};
+
+    std::cout << std::format("{:>12}", "label\\class");
+    for (const auto& name : page_class_names) {
+        std::cout << std::format("{:>12}", name);
+    }
+    std::cout << '\n';
+
+    for (std::size_t label{}; label < confusion_matrix.size(); ++label) {
+        std::cout << std::format("{:>12}", page_class_names[label]);
+        for (const auto count : confusion_matrix[label]) {
+            std::cout << std::format("{:>12}", count);
+        }
+        std::cout << '\n';
+    }
+}
+
+scan2pdf_config calibrate_thresholds(const std::vector<std::pair<page_class, page_features>>& samples, scan2pdf_config config)
+{
+    struct threshold_range {
+        double scan2pdf_config::*threshold;
+        double min;
+        double max;
+        double step;
+    };
+
+    // the ranges are wide enough to cover any sensible value of each threshold
+    constexpr std::array threshold_ranges{
+        threshold_range{&scan2pdf_config::white_percent, 0.9, 1.0, 0.001},
+        threshold_range{&scan2pdf_config::bw_mean, 0.0, 30.0, 0.5},
+        threshold_range{&scan2pdf_config::bw_stddev, 0.0, 40.0, 0.5},
+        threshold_range{&scan2pdf_config::bw_stddev_mean_diff, -5.0, 5.0, 0.1},
+        threshold_range{&scan2pdf_config::grayscale_mean, 0.0, 20.0, 0.25},
+        threshold_range{&scan2pdf_config::grayscale_maxima, 0.0, 40.0, 0.5}};
+    constexpr auto max_rounds{10};
+
+    // the thresholds depend on each other (a page has to get past is_white to reach is_bw), so we search one
+    // threshold at a time and repeat until nothing improves. the features are already computed so this is cheap.
+    auto best_cost{get_misclassification_cost(samples, config)};
+    for ([[maybe_unused]] auto _ : std::views::iota(0, max_rounds)) {
+        auto improved{false};
+        for (const auto& range : threshold_ranges) {
+            const auto steps{static_cast<int>(std::lround((range.max - range.min) / range.step))};
+            for (const auto step : std::views::iota(0, steps + 1)) {
+                auto candidate{config};
+                candidate.*range.threshold = range.min + (step * range.step);
+                if (const auto cost{get_misclassification_cost(samples, candidate)}; cost < best_cost) {
+                    best_cost = cost;
+                    config = candidate;
+                    improved = true;
+                }
+            }
+        }
+
+        if (!improved) {
+            break;
+        }
+    }
+
+    return config;
+}
+
+int calibrate(const std::filesystem::path& corpus_path, const std::filesystem::path& config_path, const scan2pdf_config& config)
+{
+    // the corpus has one directory of scans per class (e.g., corpus/bw/receipt.png)
+    constexpr std::array<std::pair<std::string_view, page_class>, 4> corpus_labels{{
+        {"white", page_class::white},
+        {"bw", page_class::bw},
+        {"grayscale", page_class::grayscale},
+        {"color", page_class::color},
+    }};
+
+    std::vector<std::pair<page_class, page_features>> samples;
+    std::chrono::milliseconds proccess_time{};
+    std::chrono::milliseconds classify_time{};
+    for (const auto& [label_name, label] : corpus_labels) {
+        if (!std::filesystem::is_directory(corpus_path / label_name)) {
+            continue;
+        }
+
+        for (const auto& entry : std::filesystem::directory_iterator(corpus_path / label_name)) {
+            if (!entry.is_regular_file()) {
+                continue;
+            }
+
+            try {
+                Magick::Image image(entry.path().string());
+
+                const auto proccess_start{std::chrono::high_resolution_clock::now()};
+                proccess(image);
+                const auto classify_start{std::chrono::high_resolution_clock::now()};
+                const auto histogram{get_luma_histogram(get_luma(image))};
+                samples.emplace_back(label, page_features{get_percent_white(histogram), get_solarized_gray_stats(histogram), get_saturation_stats(image)});
+                const auto classify_end{std::chrono::high_resolution_clock::now()};
+
+                proccess_time += std::chrono::duration_cast<std::chrono::milliseconds>(classify_start - proccess_start);
+                classify_time += std::chrono::duration_cast<std::chrono::milliseconds>(classify_end - classify_start);
+            }
+            catch (const std::exception& e) {
+                logger(hyx::logger_literals::warning, "Skipping {}: {}\n", entry.path().string(), e.what());
+            }
+        }
+    }
+
+    if (samples.empty()) {
+        std::cout << "No labelled images found in " << corpus_path << "!\n";
+        return 1;
+    }
+
+    const auto page_count{static_cast<long>(samples.size())};
+    std::cout << "Pages: " << page_count << '\n';
+    std::cout << "Processing time per page: " << (proccess_time / page_count).count() << "ms\n";
+    std::cout << "Classification time per page: " << (classify_time / page_count).count() << "ms\n";
+
+    std::cout << "\nCurrent thresholds (cost " << get_misclassification_cost(samples, config) << "):\n";
+    print_confusion_matrix(get_confusion_matrix(samples, config));
+
+    auto calibrated_config{calibrate_thresholds(samples, config)};
+    std::cout << "\nCalibrated thresholds (cost " << get_misclassification_cost(samples, calibrated_config) << "):\n";
+    print_confusion_matrix(get_confusion_matrix(samples, calibrated_config));
+
+    std::cout << '\n';
+    for (const auto& [key, value] : get_config_values(calibrated_config)) {
+        std::cout << key << " = " << *value << '\n';
+    }
+
+    save_config(config_path, calibrated_config);
+    std::cout << "Saved to " << config_path << '\n';
+
+    return 0;
+}
+
+ocr_page::ocr_page(tesseract::TessBaseAPI* tess_api, PIX* pimage, std::optional<int> orientation_prior) : m_tess_api{tess_api}, m_pimage{pimage}, m_orientation_prior{orientation_prior}
+{
+    m_tess_api->SetImage(m_pimage.get());
+}
+
+int ocr_page::orientation()
+{
+    if (!m_orientation && m_tess_api->GetPageSegMode() == tesseract::PSM_AUTO_OSD) {
+        logger("Getting orientation from recognition\n");
+
+        // the segmentation already found the orientation, so recognizing here is the only tesseract pass of the page
+        // note: the text was read in its own orientation so only the output image gets rotated
+        int ori_deg{0};
+        auto detected{false};
+        if (m_tess_api->Recognize(nullptr) == 0) {
+            if (std::unique_ptr<tesseract::ResultIterator> result_it{m_tess_api->GetIterator()}; result_it) {
+                tesseract::Orientation orientation{};
+                tesseract::WritingDirection writing_direction{};
+                tesseract::TextlineOrder textline_order{};
+                float deskew_angle{};
+                result_it->Orientation(&orientation, &writing_direction, &textline_order, &deskew_angle);
+
+                // the orientations are clockwise quarter turns (same as DetectOrientationScript())
+                ori_deg = static_cast<int>(orientation) * 90;
+                detected = true;
             }
         }
+
+        logger(hyx::logger_literals::debug, "Orientation off by {} degrees\n", ori_deg);
+
+        // there is no orientation confidence from recognition, so how well the text read in that orientation stands in
+        // for it when falling back to the prior (e.g., the front of the sheet)
+        constexpr auto min_text_confidence{50};
+        if (m_orientation_prior && (!detected || m_tess_api->MeanTextConf() < min_text_confidence)) {
+            logger(hyx::logger_literals::debug, "Using prior orientation of {} degrees\n", *m_orientation_prior);
+            ori_deg = *m_orientation_prior;
+        }
+
+        m_orientation = ori_deg;
+    }
+    else if (!m_orientation) {
+        logger("Getting orientation\n");
+
+        // default to not changing the orientation
+        int ori_deg{0};
+        float ori_conf{};
+        //// const char* script_name;
+        //// float script_conf;
+        const auto detected{m_tess_api->DetectOrientationScript(&ori_deg, &ori_conf, nullptr, nullptr)};
+
+        logger(hyx::logger_literals::debug, "Orientation off by {} degrees (confidence {})\n", ori_deg, ori_conf);
+
+        // fall back to the prior (e.g., the front of the sheet) when tesseract is unsure
+        constexpr auto min_orientation_confidence{5.0F};
+        if (m_orientation_prior && (!detected || ori_conf < min_orientation_confidence)) {
+            logger(hyx::logger_literals::debug, "Using prior orientation of {} degrees\n", *m_orientation_prior);
+            ori_deg = *m_orientation_prior;
+        }
+
+        // we only need to give tesseract a new image if the page was not upright
+        if (ori_deg != 0) {
+            m_pimage.reset(pixRotateOrth(m_pimage.get(), ori_deg / 90));
+            m_tess_api->SetImage(m_pimage.get());
+        }
+
+        m_orientation = ori_deg;
+    }
+
+    return *m_orientation;
+}
+
+const std::string& ocr_page::text()
+{
+    if (!m_text) {
+        // recognize the upright page
+        std::ignore = orientation();
+
+        logger("Collecting text\n");
+        auto ocr_text{std::unique_ptr<char[]>(m_tess_api->GetUTF8Text())};
+        m_text = (ocr_text) ? ocr_text.get() : "";
+    }
+
+    return *m_text;
+}
+
+bool ocr_page::has_text()
+{
+    return !text().empty();
+}
+
+async_writer::async_writer()
+{
+#ifdef HAVE_LIBURING
+    m_ring.emplace();
+    if (const auto result{io_uring_queue_init(global::async_write_depth, &*m_ring, 0)}; result == 0) {
+        return;
+    }
+    else {
+        // e.g., an old kernel or a sandbox without io_uring
+        logger(hyx::logger_literals::debug, "io_uring is unavailable ({}): writing from a thread instead\n", std::strerror(-result));
+        m_ring.reset();
+    }
+#endif // HAVE_LIBURING
+
+    m_worker = std::jthread([this](std::stop_token stop) { write_queued(stop); });
+}
+
+async_writer::~async_writer()
+{
+    try {
+        wait();
     }
     catch (const std::exception& e) {
-        logger(hyx::logger_literals::warning, "Failed to trim shadow: {}\n", e.what());
+        logger(hyx::logger_literals::warning, "{}\n", e.what());
     }
 
-    dump_image(image, "trim_shadow_after_trim");
+#ifdef HAVE_LIBURING
+    if (m_ring) {
+        io_uring_queue_exit(&*m_ring);
+    }
+#endif // HAVE_LIBURING
+}
 
-    return image_canvas;
+void async_writer::write(int fd, std::vector<std::uint8_t> data, std::uint64_t offset)
+{
+    SCAN2PDF_PROBE(write_start, fd, data.size(), offset);
+
+#ifdef HAVE_LIBURING
+    if (m_ring) {
+        // finished writes give their memory back as we go
+        reap_ring(false);
+        queue_ring_write(m_writes.emplace_back(pending_write{.fd = fd, .data = std::move(data), .offset = offset}));
+        return;
+    }
+#endif // HAVE_LIBURING
+
+    m_batch.push_back({.fd = fd, .data = std::move(data), .offset = offset});
+}
+
+int async_writer::open(const std::filesystem::path& path)
+{
+    const auto fd{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create \'" + path.string() + "\': " + std::strerror(errno));
+    }
+
+    m_owned_fds.push_back(fd);
+    return fd;
+}
+
+void async_writer::write(const std::filesystem::path& path, std::vector<std::uint8_t> data)
+{
+    write(open(path), std::move(data), 0);
+}
+
+void async_writer::submit()
+{
+#ifdef HAVE_LIBURING
+    if (m_ring) {
+        if (const auto result{io_uring_submit(&*m_ring)}; result < 0) {
+            fail(std::string("Failed to submit writes: ") + std::strerror(-result));
+        }
+        return;
+    }
+#endif // HAVE_LIBURING
+
+    {
+        const std::lock_guard lock(m_mutex);
+        std::ranges::move(m_batch, std::back_inserter(m_queue));
+    }
+    m_batch.clear();
+    m_changed.notify_all();
+}
+
+void async_writer::wait()
+{
+    submit();
+
+#ifdef HAVE_LIBURING
+    if (m_ring) {
+        reap_ring(true);
+        // the kernel may still be reading from a write that never completed
+        if (m_in_flight == 0) {
+            m_writes.clear();
+        }
+    }
+    else
+#endif // HAVE_LIBURING
+    {
+        std::unique_lock lock(m_mutex);
+        m_changed.wait(lock, [this] { return m_queue.empty() && !m_busy; });
+    }
+
+    // a network share may only report a failed write on close
+    for (const auto fd : m_owned_fds) {
+        if (close(fd) != 0) {
+            fail(std::string("Failed to close written file: ") + std::strerror(errno));
+        }
+    }
+    m_owned_fds.clear();
+
+    const std::lock_guard lock(m_mutex);
+    if (!m_error.empty()) {
+        throw std::runtime_error(std::exchange(m_error, {}));
+    }
+}
+
+void async_writer::fail(const std::string& error)
+{
+    const std::lock_guard lock(m_mutex);
+    if (m_error.empty()) {
+        m_error = error;
+    }
+}
+
+#ifdef HAVE_LIBURING
+void async_writer::queue_ring_write(pending_write& pending)
+{
+    auto* sqe{io_uring_get_sqe(&*m_ring)};
+    if (!sqe) {
+        // the submission queue is full, so this batch goes now
+        io_uring_submit(&*m_ring);
+        sqe = io_uring_get_sqe(&*m_ring);
+    }
+    if (!sqe) {
+        throw std::runtime_error("Failed to queue write");
+    }
+
+    io_uring_prep_write(sqe, pending.fd, pending.data.data() + pending.written, static_cast<unsigned>(pending.data.size() - pending.written), pending.offset + pending.written);
+    io_uring_sqe_set_data(sqe, &pending);
+    ++m_in_flight;
+}
+
+void async_writer::reap_ring(bool wait_for_all)
+{
+    while (m_in_flight != 0) {
+        io_uring_cqe* cqe{};
+        if (const auto result{wait_for_all ? io_uring_wait_cqe(&*m_ring, &cqe) : io_uring_peek_cqe(&*m_ring, &cqe)}; result == -EINTR) {
+            continue;
+        }
+        else if (result < 0) {
+            if (wait_for_all) {
+                fail(std::string("Failed to wait for writes: ") + std::strerror(-result));
+            }
+            return;
+        }
+
+        auto* pending{static_cast<pending_write*>(io_uring_cqe_get_data(cqe))};
+        const auto written{cqe->res};
+        io_uring_cqe_seen(&*m_ring, cqe);
+        --m_in_flight;
+
+        if (written < 0) {
+            fail(std::string("Failed to write: ") + std::strerror(-written));
+        }
+        else if (written == 0) {
+            fail("Failed to write: no progress");
+        }
+        // a short write carries on where it stopped
+        else if (pending->written += static_cast<std::size_t>(written); pending->written < pending->data.size()) {
+            queue_ring_write(*pending);
+            io_uring_submit(&*m_ring);
+            continue;
+        }
+
+        SCAN2PDF_PROBE(write_end, pending->fd, pending->written, pending->offset);
+        m_writes.remove_if([pending](const auto& write) { return &write == pending; });
+    }
 }
+#endif // HAVE_LIBURING
+
+void async_writer::write_queued(std::stop_token stop)
+{
+    while (true) {
+        pending_write pending;
+        {
+            std::unique_lock lock(m_mutex);
+            // queued writes still get written once we are asked to stop
+            if (!m_changed.wait(lock, stop, [this] { return !m_queue.empty(); })) {
+                return;
+            }
+            pending = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_busy = true;
+        }
+
+        std::string error;
+        while (error.empty() && (pending.written < pending.data.size())) {
+            if (const auto written{pwrite(pending.fd, pending.data.data() + pending.written, pending.data.size() - pending.written, static_cast<off_t>(pending.offset + pending.written))}; written > 0) {
+                pending.written += static_cast<std::size_t>(written);
+            }
+            else if ((written < 0) && (errno == EINTR)) {
+                continue;
+            }
+            else {
+                error = (written < 0) ? std::string("Failed to write: ") + std::strerror(errno) : "Failed to write: no progress";
+            }
+        }
 
-void transform_to_bw(Magick::Image& image)
-{
-    logger(hyx::logger_literals::debug, "Converting to black and white\n");
+        SCAN2PDF_PROBE(write_end, pending.fd, pending.written, pending.offset);
 
-    constexpr auto brightness{0.0};
-    constexpr auto constrast{30.0};
-    image.brightnessContrast(brightness, constrast);
-    image.autoThreshold(Magick::KapurThresholdMethod);
+        {
+            const std::lock_guard lock(m_mutex);
+            m_busy = false;
+            if (!error.empty() && m_error.empty()) {
+                m_error = error;
+            }
+        }
+        m_changed.notify_all();
+    }
 }
 
-void transform_with_text_to_bw(Magick::Image& image)
+raw_archive_writer::raw_archive_writer(const std::filesystem::path& path, bool duplex) : m_fd{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)}
 {
-    logger(hyx::logger_literals::debug, "Converting to black and white\n");
+    if (m_fd < 0) {
+        throw std::runtime_error("Failed to create raw archive: \'" + path.string() + "\'");
+    }
 
-    // magick in.png -auto-level -unsharp 0x2+1.5+0.05 -resize 200% -auto-threshold otsu out.pdf
+    // a reprocessed scan has to know which frames are back sides
+    const auto flags{duplex ? global::raw_archive_duplex : std::uint64_t{}};
+    std::vector<std::uint8_t> header(global::raw_archive_magic.begin(), global::raw_archive_magic.end());
+    header.resize(header.size() + sizeof(flags));
+    std::memcpy(header.data() + global::raw_archive_magic.size(), &flags, sizeof(flags));
 
-    image.autoLevel();
-    constexpr auto unsharp_radius{0.0};
-    constexpr auto unsharp_sigma{2.0};
-    constexpr auto unsharp_amount{1.5};
-    constexpr auto unsharp_threshold{0.05};
-    image.unsharpmask(unsharp_radius, unsharp_sigma, unsharp_amount, unsharp_threshold);
-    image.autoThreshold(Magick::OTSUThresholdMethod);
+    m_size = header.size();
+    m_writer.write(m_fd, std::move(header), 0);
 }
 
-void transform_to_grayscale(Magick::Image& image)
+raw_archive_writer::~raw_archive_writer()
 {
-    logger(hyx::logger_literals::debug, "Converting to greyscale\n");
+    // the reader maps the index straight out of the file, so it has to be aligned
+    std::vector<std::uint8_t> tail((alignof(raw_archive_entry) - (m_size % alignof(raw_archive_entry))) % alignof(raw_archive_entry));
+    const auto append_to_tail{[&tail](const void* data, std::size_t size) {
+        const auto* const bytes{static_cast<const std::uint8_t*>(data)};
+        tail.insert(tail.end(), bytes, bytes + size);
+    }};
+
+    const auto index_offset{static_cast<std::uint64_t>(m_size + tail.size())};
+    const auto page_count{static_cast<std::uint64_t>(m_index.size())};
+    append_to_tail(m_index.data(), m_index.size() * sizeof(raw_archive_entry));
+    append_to_tail(&page_count, sizeof(page_count));
+    append_to_tail(&index_offset, sizeof(index_offset));
+    append_to_tail(global::raw_archive_magic.data(), global::raw_archive_magic.size());
+    m_writer.write(m_fd, std::move(tail), m_size);
 
-    constexpr auto brightness{0.0};
-    constexpr auto contrast{30.0};
-    image.brightnessContrast(brightness, contrast);
-    image.opaque(Magick::Color("white"), Magick::Color("white"));
-    image.colorSpace(Magick::LinearGRAYColorspace);
+    try {
+        m_writer.wait();
+    }
+    catch (const std::exception& e) {
+        logger(hyx::logger_literals::warning, "Failed to write raw archive: {}\n", e.what());
+    }
+    close(m_fd);
 }
 
-int get_orientation(tesseract::TessBaseAPI* tess_api, PIX* pimage)
+void raw_archive_writer::append(const raw_frame& frame)
 {
-    logger("Getting orientation\n");
-    tess_api->SetImage(pimage);
+    raw_archive_entry entry{
+        .offset = m_size,
+        .stored_size = frame.data.size(),
+        .raw_size = frame.data.size(),
+        .compression = static_cast<std::int32_t>(raw_archive_compression::none),
+        .format = frame.params.format,
+        .last_frame = frame.params.last_frame,
+        .bytes_per_line = frame.params.bytes_per_line,
+        .pixels_per_line = frame.params.pixels_per_line,
+        .lines = frame.params.lines,
+        .depth = frame.params.depth,
+        .resolution = frame.resolution};
+
+#ifdef HAVE_ZSTD
+    std::vector<std::uint8_t> stored(ZSTD_compressBound(frame.data.size()));
+    const auto compressed_size{ZSTD_compress(stored.data(), stored.size(), frame.data.data(), frame.data.size(), global::raw_archive_zstd_level)};
+    if (ZSTD_isError(compressed_size)) {
+        throw std::runtime_error(std::string("Failed to compress frame: ") + ZSTD_getErrorName(compressed_size));
+    }
 
-    // default to not changing the orientation
-    int ori_deg{0};
-    //// float ori_conf;
-    //// const char* script_name;
-    //// float script_conf;
-    tess_api->DetectOrientationScript(&ori_deg, nullptr, nullptr, nullptr);
+    stored.resize(compressed_size);
+    entry.stored_size = compressed_size;
+    entry.compression = static_cast<std::int32_t>(raw_archive_compression::zstd);
+#else
+    std::vector<std::uint8_t> stored(frame.data.begin(), frame.data.end());
+#endif // !HAVE_ZSTD
 
-    logger(hyx::logger_literals::debug, "Orientation off by {} degrees\n", ori_deg);
+    m_size += stored.size();
+    m_writer.write(m_fd, std::move(stored), entry.offset);
+    m_writer.submit();
 
-    return ori_deg;
+    m_index.push_back(entry);
+    logger(hyx::logger_literals::debug, "Archived frame of {} bytes in {} bytes\n", entry.raw_size, entry.stored_size);
 }
 
-bool is_grayscale(Magick::Image image)
+raw_archive_reader::raw_archive_reader(const std::filesystem::path& path)
 {
-    // constinit static const auto log_prefix{"Grayscale Check"};
-
-    // magick in.png -colorspace HSB -resize 2% -format "%[fx:mean.g] %[fx:maxima.g]\n" info:-
-
-    image.colorSpace(Magick::HSBColorspace);
-    image.resize("2%");
-
-    const auto image_saturation_stats{image.statistics().channel(Magick::PixelChannel::GreenPixelChannel)};
-    const auto mean_saturation{quantum_to_percent(image_saturation_stats.mean())};
-    const auto maxima_saturation{quantum_to_percent(image_saturation_stats.maxima())};
+    const auto fd{open(path.c_str(), O_RDONLY)};
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open raw archive: \'" + path.string() + "\'");
+    }
 
-    logger(hyx::logger_literals::debug, "Saturation mean: {}%\n", mean_saturation);
-    logger(hyx::logger_literals::debug, "Saturation maxima: {}%\n", maxima_saturation);
+    m_size = std::filesystem::file_size(path);
+    auto* const data{mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map raw archive: \'" + path.string() + "\'");
+    }
+    m_data = static_cast<const std::uint8_t*>(data);
+
+    // both versions have magics of the same size, and only the current one has flags after its magic
+    const auto& magic{global::raw_archive_magic};
+    static_assert(global::raw_archive_magic_v1.size() == global::raw_archive_magic.size());
+    constexpr auto footer_size{(2 * sizeof(std::uint64_t)) + magic.size()};
+    const auto has_magic{[this](std::string_view expected, std::size_t offset) { return std::equal(expected.begin(), expected.end(), m_data + offset); }};
+
+    std::uint64_t page_count{};
+    std::uint64_t index_offset{};
+    std::size_t header_size{};
+    if (m_size >= (magic.size() + sizeof(std::uint64_t) + footer_size) && has_magic(magic, 0) && has_magic(magic, m_size - magic.size())) {
+        std::uint64_t flags{};
+        std::memcpy(&flags, m_data + magic.size(), sizeof(flags));
+        m_duplex = (flags & global::raw_archive_duplex) != 0;
+        header_size = magic.size() + sizeof(flags);
+    }
+    else if (m_size >= (magic.size() + footer_size) && has_magic(global::raw_archive_magic_v1, 0) && has_magic(global::raw_archive_magic_v1, m_size - magic.size())) {
+        logger(hyx::logger_literals::warning, "Raw archive does not say if it was scanned duplex: treating every frame as a front side\n");
+        header_size = magic.size();
+    }
+    if (header_size != 0) {
+        std::memcpy(&page_count, m_data + m_size - footer_size, sizeof(page_count));
+        std::memcpy(&index_offset, m_data + m_size - footer_size + sizeof(page_count), sizeof(index_offset));
+    }
 
-    constexpr auto mean_threashold{5.0};
-    constexpr auto maxima_threashold{10.0};
-    // if we have small mean saturation and no large spike (maxima) of saturation anywhere, image is grayscale
-    if (mean_saturation < mean_threashold && maxima_saturation < maxima_threashold) {
-        return true;
+    if ((header_size == 0) || (index_offset < header_size) || (index_offset % alignof(raw_archive_entry) != 0) || (page_count > (m_size - footer_size - index_offset) / sizeof(raw_archive_entry))) {
+        munmap(const_cast<std::uint8_t*>(m_data), m_size);
+        throw std::runtime_error("Not a complete raw archive: \'" + path.string() + "\'");
     }
 
-    // if we have high mean, image is not grayscale
-    // if we have high maxima, image contains some significant color (e.g., logo)
-    return false;
+    m_index = {reinterpret_cast<const raw_archive_entry*>(m_data + index_offset), page_count};
 }
 
-bool is_bw(Magick::Image image)
+raw_archive_reader::~raw_archive_reader()
 {
-    // constinit static const auto log_prefix{"BW Check"};
-
-    // magick in.png -solarize 50% -colorspace gray -identify -verbose info:
-
-    image.solarize(50_quantum_percent);
-    image.colorSpace(Magick::GRAYColorspace);
-
-    auto image_gray_stats{image.statistics().channel(Magick::PixelChannel::GrayPixelChannel)};
-    auto mean_gray{quantum_to_percent(image_gray_stats.mean())};
-    auto stddev_gray{quantum_to_percent(image_gray_stats.standardDeviation())};
-
-    logger(hyx::logger_literals::debug, "Gray mean: {}\n", mean_gray);
-    logger(hyx::logger_literals::debug, "Gray standard deviation: {}\n", stddev_gray);
-
-    constexpr auto mean_threshold{12.0};
-    constexpr auto stddev_threshold{18.0};
-    constexpr auto stddev_mean_diff_threashold{-0.6};
-    // if we have close to zero mean and small, but larger than mean, deviation, image is bw
-    // (we will allow a small padding for close deviation and mean difference to prefer bw over other options when it's unclear)
-    if (mean_gray < mean_threshold && stddev_gray < stddev_threshold && (stddev_gray - mean_gray) > stddev_mean_diff_threashold) {
-        return true;
-    }
+    munmap(const_cast<std::uint8_t*>(m_data), m_size);
+}
 
-    // if we have any other case, image is not bw
-    return false;
+std::size_t raw_archive_reader::size() const
+{
+    return m_index.size();
 }
 
-bool is_white(Magick::Image image)
+bool raw_archive_reader::duplex() const
 {
-    // constinit static const auto log_prefix{"All White Check"};
+    return m_duplex;
+}
 
-    image.whiteThreshold("75%");
-    const auto percent_white{std::stod(image.formatExpression("%[fx:mean]"))};
+raw_frame raw_archive_reader::frame(std::size_t page) const
+{
+    if (page >= m_index.size()) {
+        throw std::out_of_range("No page " + std::to_string(page) + " in raw archive");
+    }
 
-    logger(hyx::logger_literals::debug, "Percent white: {}\n", percent_white);
+    const auto& entry{m_index[page]};
+    if ((entry.offset > m_size) || (entry.stored_size > m_size - entry.offset)) {
+        throw std::runtime_error("Raw archive page " + std::to_string(page) + " is out of bounds");
+    }
 
-    constexpr auto percent_white_threshold{0.99};
-    if (percent_white > percent_white_threshold) {
-        return true;
+    raw_frame frame{
+        .params = {
+            .format = static_cast<SANE_Frame>(entry.format),
+            .last_frame = entry.last_frame,
+            .bytes_per_line = entry.bytes_per_line,
+            .pixels_per_line = entry.pixels_per_line,
+            .lines = entry.lines,
+            .depth = entry.depth},
+        .resolution = entry.resolution,
+        .data = std::vector<SANE_Byte>(entry.raw_size)};
+
+    const auto* const stored{m_data + entry.offset};
+    switch (static_cast<raw_archive_compression>(entry.compression)) {
+    case raw_archive_compression::none:
+        if (entry.stored_size != entry.raw_size) {
+            throw std::runtime_error("Raw archive page " + std::to_string(page) + " has a bad size");
+        }
+        std::copy(stored, stored + entry.stored_size, frame.data.begin());
+        break;
+    case raw_archive_compression::zstd:
+#ifdef HAVE_ZSTD
+        if (const auto raw_size{ZSTD_decompress(frame.data.data(), frame.data.size(), stored, entry.stored_size)}; ZSTD_isError(raw_size) || (raw_size != entry.raw_size)) {
+            throw std::runtime_error("Failed to decompress raw archive page " + std::to_string(page));
+        }
+        break;
+#else
+        throw std::runtime_error("Raw archive is zstd compressed, but scan2pdf was built without zstd");
+#endif // !HAVE_ZSTD
+    default:
+        throw std::runtime_error("Unknown compression in raw archive page " + std::to_string(page));
     }
 
-    return false;
+    return frame;
 }
 
-bool has_text(tesseract::TessBaseAPI* tess_api, PIX* pimage)
+event_stream::event_stream(int fd) : m_fd{fd}
 {
-    tess_api->SetImage(pimage);
-    std::string image_text{tess_api->GetUTF8Text()};
-    return !image_text.empty();
+    // a front-end that goes away should not take the scan with it
+    std::signal(SIGPIPE, SIG_IGN);
+    m_writer = std::jthread([this](std::stop_token stop) { write_events(stop); });
 }
 
-PIX* magick2pix(Magick::Image& image)
+void event_stream::emit(std::string_view event, std::initializer_list<std::pair<std::string_view, std::string>> values)
 {
-    Magick::Blob bimage;
-    image.write(&bimage, "tiff");
-    return pixReadMemTiff(static_cast<const unsigned char*>(bimage.data()), bimage.length(), 0);
+    const auto now{std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())};
+    auto line{"{\"event\": " + to_json_string(event) + ", \"time_ms\": " + std::to_string(now.count())};
+    for (const auto& [name, value] : values) {
+        line += ", " + to_json_string(name) + ": " + value;
+    }
+    line += "}\n";
+
+    {
+        const std::lock_guard lock(m_mutex);
+        // a reader that keeps up never gets here; one that does not only loses events, not pages
+        if (m_events.size() >= global::event_queue_limit) {
+            ++m_dropped;
+            return;
+        }
+        m_events.push_back(std::move(line));
+    }
+    m_pending.notify_one();
 }
 
-std::string get_text(tesseract::TessBaseAPI* tess_api, PIX* pimage)
+void event_stream::write_events(std::stop_token stop)
 {
-    tess_api->SetImage(pimage);
-    auto ocr_text{std::unique_ptr<char[]>(tess_api->GetUTF8Text())};
-    return (ocr_text) ? ocr_text.get() : "";
+    // a reader that keeps the stream open without reading would otherwise block the end of the job forever
+    std::optional<std::chrono::steady_clock::time_point> flush_deadline;
+    const auto wait_writable{[this, &stop, &flush_deadline] {
+        for (;;) {
+            if (stop.stop_requested() && !flush_deadline) {
+                flush_deadline = std::chrono::steady_clock::now() + global::event_flush_timeout;
+            }
+
+            // the stop request is only seen between polls
+            constexpr std::chrono::milliseconds poll_interval{100};
+            const auto timeout{flush_deadline ? std::max(std::chrono::duration_cast<std::chrono::milliseconds>(*flush_deadline - std::chrono::steady_clock::now()), std::chrono::milliseconds{}) : poll_interval};
+            pollfd writable{.fd = m_fd, .events = POLLOUT, .revents = 0};
+            if (const auto result{poll(&writable, 1, static_cast<int>(timeout.count()))}; result > 0) {
+                return true;
+            }
+            else if ((result == 0) && flush_deadline) {
+                return false;
+            }
+            else if ((result < 0) && (errno != EINTR)) {
+                return true; // the write reports the error
+            }
+        }
+    }};
+
+    for (auto open{true}; open;) {
+        std::deque<std::string> events;
+        std::size_t dropped{};
+        {
+            std::unique_lock lock(m_mutex);
+            // pending events still get written once we are asked to stop
+            if (!m_pending.wait(lock, stop, [this] { return !m_events.empty(); }) && m_events.empty()) {
+                return;
+            }
+            std::swap(events, m_events);
+            std::swap(dropped, m_dropped);
+        }
+
+        if (dropped != 0) {
+            logger(hyx::logger_literals::warning, "Event stream reader is falling behind: dropped {} events\n", dropped);
+        }
+
+        for (std::size_t idx{}; idx < events.size(); ++idx) {
+            const auto& line{events[idx]};
+            for (std::size_t written{}; open && (written < line.size());) {
+                if (!wait_writable()) {
+                    const std::lock_guard lock(m_mutex);
+                    logger(hyx::logger_literals::warning, "Event stream reader stopped reading: dropped {} events\n", events.size() - idx + m_events.size() + m_dropped);
+                    return;
+                }
+
+                // a writable pipe has room for PIPE_BUF bytes, so a write of no more than that never blocks
+                if (const auto result{write(m_fd, line.data() + written, std::min<std::size_t>(line.size() - written, PIPE_BUF))}; result >= 0) {
+                    written += static_cast<std::size_t>(result);
+                }
+                else if (errno != EINTR) {
+                    logger(hyx::logger_literals::warning, "Failed to write event stream: {}\n", std::strerror(errno));
+                    open = false;
+                }
+            }
+        }
+    }
 }
 
 int main(int argc, char** argv)
@@ -517,8 +3307,23 @@ int main(int argc, char** argv)
     std::filesystem::path outpath{"./"};
     const hyx::temporary_path tmppath{std::filesystem::temp_directory_path() / "scan2pdf"};
     std::filesystem::path logpath{hyx::log_path() / "scan2pdf"};
+    std::filesystem::path config_path{hyx::home_path() / ".config/scan2pdf/scan2pdf.conf"};
+    std::filesystem::path corpus_path;
+    std::filesystem::path archive_path;
+    std::filesystem::path reprocess_path;
+    std::filesystem::path index_path{hyx::home_path() / ".local/share/scan2pdf/index"};
+    std::optional<std::string> search_query;
+    auto known_action{known_document_action::keep};
+    std::optional<int> events_fd;
+    auto priority{job_priority::interactive};
+    scan2pdf_config config;
 
     auto auto_mode{false};
+    auto single_pass_ocr{false};
+    auto drop_duplicates{false};
+    auto split_mode{false};
+    auto preview_mode{false};
+    auto text_only{false};
 
     // empty
     if (argc == 1) {
@@ -549,6 +3354,58 @@ int main(int argc, char** argv)
                 return 1;
             }
         }
+        else if (((arg == "-c") || (arg == "--config")) && ((idx + 1) < argc)) {
+            config_path = std::filesystem::absolute(argv[++idx]);
+        }
+        else if (arg.starts_with("--calibrate=")) {
+            corpus_path = std::filesystem::absolute(arg.substr(arg.find('=') + 1));
+        }
+        else if (((arg == "-s") || (arg == "--source")) && ((idx + 1) < argc)) {
+            // argv outlives the options so we can keep the pointer
+            sane_options.at(SANE_NAME_SCAN_SOURCE) = static_cast<SANE_String_Const>(argv[++idx]);
+        }
+        else if (arg.starts_with("--archive=")) {
+            archive_path = std::filesystem::absolute(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.starts_with("--reprocess=")) {
+            reprocess_path = std::filesystem::absolute(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.starts_with("--index=")) {
+            index_path = std::filesystem::absolute(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.starts_with("--search=")) {
+            search_query = arg.substr(arg.find('=') + 1);
+        }
+        else if (arg == "--known=skip") {
+            known_action = known_document_action::skip;
+        }
+        else if (arg == "--known=link") {
+            known_action = known_document_action::link;
+        }
+        else if (arg == "--text-only") {
+            text_only = true;
+        }
+        else if (arg == "--priority=interactive") {
+            priority = job_priority::interactive;
+        }
+        else if (arg == "--priority=bulk") {
+            priority = job_priority::bulk;
+        }
+        else if (arg.starts_with("--events-fd=")) {
+            events_fd = std::stoi(std::string(arg.substr(arg.find('=') + 1)));
+        }
+        else if (arg == "--preview") {
+            preview_mode = true;
+        }
+        else if (arg == "--split") {
+            split_mode = true;
+        }
+        else if (arg == "--single-pass-ocr") {
+            single_pass_ocr = true;
+        }
+        else if (arg == "--drop-duplicates") {
+            drop_duplicates = true;
+        }
         else if (arg.starts_with("--auto=")) {
             auto_mode = true;
             filename = arg.substr(arg.find('=') + 1);
@@ -565,7 +3422,7 @@ int main(int argc, char** argv)
         }
     }
 
-    if (filename.empty()) {
+    if (filename.empty() && corpus_path.empty() && !search_query) {
         std::cout << "No filename detected!\n";
         return 1;
     }
@@ -580,12 +3437,32 @@ int main(int argc, char** argv)
         // it is ok to continue without logging opened.
     }
 
+    // searching only needs the index, so none of the components get initialized
+    if (search_query) {
+        try {
+            return search_index(index_path, *search_query);
+        }
+        catch (const std::exception& e) {
+            std::cout << "Failed to search: " << e.what() << '\n';
+            logger(hyx::logger_literals::fatal, "Failed to search: {}\n", e.what());
+            return 1;
+        }
+    }
+
+    // before any component starts a thread, so they all run at the job's priority
+    set_job_priority(priority);
+
     hyx::sane_init* sane{};
     std::unique_ptr<tesseract::TessBaseAPI> tess_api;
 
+    // before anything slow starts, so a SIGHUP (e.g., sent to every job after editing the config) never ends a job
+    std::signal(SIGHUP, [](int) { reload_config_requested = true; });
+
     try {
         logger("Initializing components\n");
 
+        config = load_config(config_path);
+
         SANE_Int sane_version{};
         sane = &hyx::sane_init::get_instance(&sane_version);
         if (sane_version) [[likely]] {
@@ -596,10 +3473,13 @@ int main(int argc, char** argv)
         }
 
         tess_api = std::make_unique<tesseract::TessBaseAPI>();
-        if (tess_api->Init(nullptr, "eng")) {
-            throw std::runtime_error("Could not initialize tesseract");
+        if (tess_api->Init(nullptr, config.language.c_str())) {
+            throw std::runtime_error("Could not initialize tesseract for \'" + config.language + "\'");
         }
         tess_api->SetVariable("debug_file", (logpath / "tess.log").c_str());
+        if (single_pass_ocr) {
+            tess_api->SetPageSegMode(tesseract::PSM_AUTO_OSD);
+        }
         logger(hyx::logger_literals::debug, "Initialized Tesseract {}\n", tess_api->Version());
 
         Magick::InitializeMagick(*argv);
@@ -626,10 +3506,98 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (!corpus_path.empty()) {
+        try {
+            return calibrate(corpus_path, config_path, config);
+        }
+        catch (const std::exception& e) {
+            std::cout << "Failed to calibrate: " << e.what() << '\n';
+            logger(hyx::logger_literals::fatal, "Failed to calibrate: {}\n", e.what());
+            return 1;
+        }
+    }
+
+    // a front-end follows the job through these while it runs
+    std::optional<event_stream> events;
+    if (events_fd) {
+        events.emplace(*events_fd);
+    }
+    const auto emit_event{[&events](std::string_view event, std::initializer_list<std::pair<std::string_view, std::string>> values = {}) {
+        if (events) {
+            events->emit(event, values);
+        }
+    }};
+
+    // every job leaves a manifest, whether it finishes or not
+    job_manifest manifest;
+    const auto save_manifest{[&manifest, &logpath, &emit_event](std::string_view result) {
+        manifest.result = result;
+        try {
+            save_job_manifest(logpath / "jobs", manifest);
+        }
+        catch (const std::exception& e) {
+            logger(hyx::logger_literals::warning, "Failed to save job manifest: {}\n", e.what());
+        }
+        emit_event("job_finished", {{"result", to_json_string(result)}, {"document", to_json_string(manifest.document)}});
+    }};
+    const auto add_stage_time{[&manifest](const std::string& stage, std::chrono::high_resolution_clock::time_point start) {
+        manifest.stage_times[stage] += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+    }};
+
     try {
-        hyx::sane_device* device{sane->open_device()};
+        // a reprocessed document comes from the frames of an earlier scan instead of the scanner
+        std::optional<raw_archive_reader> reprocess_archive;
+        hyx::sane_device* device{};
+        if (!reprocess_path.empty()) {
+            reprocess_archive.emplace(reprocess_path);
+            logger("Reprocessing {} frames from {}\n", reprocess_archive->size(), reprocess_path.string());
+        }
+        else {
+            device = sane->open_device();
+            set_device_options(device);
+
+            // a preview of a flatbed page tells us how little we need to scan it with
+            if (preview_mode && (std::string_view(std::any_cast<SANE_String_Const>(sane_options.at(SANE_NAME_SCAN_SOURCE))).find("Flatbed") != std::string_view::npos)) {
+                switch (get_preview_class(device, config)) {
+                case page_class::bw:
+                    sane_options.at(SANE_NAME_SCAN_MODE) = static_cast<SANE_String_Const>(SANE_VALUE_SCAN_MODE_GRAY);
+                    sane_options.at(SANE_NAME_SCAN_RESOLUTION) = std::min(std::any_cast<SANE_Word>(sane_options.at(SANE_NAME_SCAN_RESOLUTION)), global::text_resolution);
+                    break;
+                case page_class::grayscale:
+                    sane_options.at(SANE_NAME_SCAN_MODE) = static_cast<SANE_String_Const>(SANE_VALUE_SCAN_MODE_GRAY);
+                    break;
+                case page_class::white:
+                case page_class::color:
+                    break;
+                }
+                set_device_options(device);
+                logger(hyx::logger_literals::debug, "Scanning in {} mode at {}dpi\n", std::any_cast<SANE_String_Const>(sane_options.at(SANE_NAME_SCAN_MODE)), std::any_cast<SANE_Word>(sane_options.at(SANE_NAME_SCAN_RESOLUTION)));
+            }
+            else if (preview_mode) {
+                logger(hyx::logger_literals::warning, "Previews only work with a flatbed source\n");
+            }
+        }
+
+        // every page of a document is classified, reduced and read with the same snapshot of the config, and a job is one
+        // document, so a changed config only gets checked here (a missing one is an error, not the defaults) and is
+        // read by the next job
+        const auto check_config{[&config_path]() {
+            try {
+                std::ignore = load_config(config_path, true);
+                logger("Config at {} changed: it applies from the next job on\n", config_path.string());
+            }
+            catch (const std::exception& e) {
+                logger(hyx::logger_literals::warning, "Changed config at {} cannot be used: {}\n", config_path.string(), e.what());
+            }
+        }};
+
+        // duplex frames come in front/back pairs of the same sheet (a reprocessed scan knows if it was duplex)
+        const auto duplex{reprocess_archive ? reprocess_archive->duplex() : std::string_view(std::any_cast<SANE_String_Const>(sane_options.at(SANE_NAME_SCAN_SOURCE))) == "ADF Duplex"};
 
-        set_device_options(device);
+        std::optional<raw_archive_writer> raw_archive;
+        if (!archive_path.empty() && !reprocess_archive) {
+            raw_archive.emplace(archive_path, duplex);
+        }
 
         if (!std::filesystem::exists(tmppath)) {
             std::filesystem::create_directory(tmppath);
@@ -638,16 +3606,292 @@ int main(int argc, char** argv)
         // we start processing images
         logger("Scanning Document\n");
         std::atomic<bool> done_scanning{false};
-        hyx::circular_buffer<Magick::Image> images_buffer;
+        hyx::circular_buffer<scanned_image> images_buffer;
         std::vector<Magick::Image> images;
+        // images that go into the pdf as the scanner compressed them (by position in images)
+        std::unordered_map<std::size_t, std::vector<SANE_Byte>> pass_through_pages;
+        // resolution each image goes into the pdf with (0 keeps it as it is)
+        std::vector<double> output_resolutions;
         std::string document_text{};
+        std::vector<std::string> page_texts;
+        std::deque<page_hash> recent_page_hashes;
+        std::optional<document_fields> barcode_fields;
+
+        // the record of the page being digested, and where the records of the kept pages are (by position in images)
+        page_record current_page;
+        std::vector<std::size_t> kept_records;
+        const auto record_decision{[&emit_event](page_record& record, std::string_view decision) {
+            record.decision = decision;
+            emit_event((decision == "kept") ? "page_kept" : "page_removed", {{"frame", std::to_string(record.frame)}, {"decision", to_json_string(decision)}});
+        }};
+
+        std::optional<page_geometry> front_geometry;
+        std::optional<int> front_orientation;
+        // the back of a sheet is the front turned over, so a front turned a quarter one way has its back turned the other
+        const auto get_orientation_prior{[&front_orientation](bool back_side) -> std::optional<int> {
+            if (!back_side || !front_orientation) {
+                return std::nullopt;
+            }
+            return (360 - *front_orientation) % 360;
+        }};
+
+        // a rescan of an archived document is caught by its page hashes before any OCR, and confirmed by its text
+        const auto fingerprints{load_fingerprints(outpath / global::fingerprint_store)};
+        std::vector<page_hash> document_page_hashes;
+        std::vector<const document_fingerprint*> known_candidates;
+        std::vector<deferred_page> deferred_pages;
+        if (known_action != known_document_action::keep) {
+            std::ranges::transform(fingerprints, std::back_inserter(known_candidates), [](const auto& fingerprint) { return &fingerprint; });
+        }
+
+        const auto handle_known_document{[&](const document_fingerprint& known) {
+            std::cout << "Document is already archived as " << known.document << '\n';
+            logger(hyx::logger_literals::warning, "Document is already archived as {}\n", known.document.string());
+
+            if (known_action == known_document_action::link) {
+                // an auto name would resolve to the known document's name anyway
+                const auto link_path{auto_mode ? outpath / known.document.filename() : outpath / (filename + ".pdf")};
+                if (!std::filesystem::exists(std::filesystem::symlink_status(link_path))) {
+                    std::filesystem::create_symlink(known.document, link_path);
+                    logger(hyx::logger_literals::debug, "Linked {} to the known document\n", link_path.string());
+                }
+            }
+        }};
+
+        // only the time spent in tesseract counts as ocr
+        const auto finish_ocr{[&manifest, &emit_event](const page_record& record, std::chrono::milliseconds ocr_time) {
+            logger(hyx::logger_literals::debug, "OCR finished in {:%Q%q}\n", ocr_time);
+            manifest.stage_times["ocr"] += ocr_time;
+            emit_event("ocr_done", {{"frame", std::to_string(record.frame)}, {"has_text", *record.has_text ? "true" : "false"}, {"orientation", std::to_string(*record.orientation)}, {"ms", std::to_string(ocr_time.count())}});
+        }};
+
+        // OCR, reduce and keep a page
+        const auto finish_page{[&](Magick::Image& image, const luma_image& luma, const luma_histogram& histogram, bool back_side, std::optional<raw_frame> jpeg_frame) {
+            // a jpeg page was classified on its proxy, but OCR and barcodes need the full resolution (the page hash and
+            // the statistics stay with the proxy)
+            std::optional<Magick::Image> full_image;
+            if (jpeg_frame) {
+                full_image = frame_to_image(*jpeg_frame);
+                full_image->compressType(Magick::LZWCompression);
+            }
+
+            // a barcode on the first page can name the document without any text parsing
+            if (auto_mode && images.empty()) {
+                barcode_fields = get_barcode_fields(full_image ? get_luma(*full_image) : luma);
+            }
+
+            auto& record{manifest.pages[kept_records[images.size()]]};
+            SCAN2PDF_PROBE(classify_start, record.frame, image.columns(), image.rows());
+            std::optional<ocr_page> page;
+            std::chrono::milliseconds ocr_time{};
+            // all of the tesseract work on a page happens here; its orientation and text are only read back afterwards
+            const auto recognize{[&](PIX* pimage) {
+                SCAN2PDF_PROBE(ocr_start, record.frame, pixGetWidth(pimage), pixGetHeight(pimage));
+                const auto ocr_start{std::chrono::high_resolution_clock::now()};
+                page.emplace(tess_api.get(), pimage, get_orientation_prior(back_side));
+                std::ignore = page->has_text();
+                ocr_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - ocr_start);
+                SCAN2PDF_PROBE(ocr_end, record.frame, page->text().size());
+            }};
+
+            // bilevel and palette pages would lose what makes them small if they got resampled
+            auto output_resolution{0.0};
+            if (is_bw(get_solarized_gray_stats(histogram), config)) {
+                // most bw pages have text, so we binarize for text and only redo it if tesseract finds none.
+                // the bilevel pixels go to tesseract as-is so it can skip thresholding them again.
+                record.reduction = "bw";
+                const auto bilevel{transform_with_text_to_bw(image, luma, histogram)};
+                recognize(full_image ? magick2pix(*full_image) : bilevel2pix(bilevel, static_cast<int>(image.density().x())));
+                if (!page->has_text()) {
+                    transform_to_bw(image, luma, histogram);
+                }
+            }
+            else {
+                if (is_grayscale(get_saturation_stats(image), config)) {
+                    transform_to_grayscale(image);
+                    output_resolution = config.grayscale_dpi;
+                    record.reduction = "grayscale";
+                }
+                else if (const auto palette_colors{get_palette_colors(image)}; palette_colors != 0) {
+                    transform_to_palette(image, palette_colors);
+                    record.reduction = "palette";
+                }
+                // else, image is color
+                else {
+                    output_resolution = config.color_dpi;
+                    record.reduction = "color";
+                }
+
+                recognize(magick2pix(full_image ? *full_image : image));
+            }
+
+            dump_image(image, "reduced");
+            emit_event("page_classified", {{"frame", std::to_string(record.frame)}, {"reduction", to_json_string(*record.reduction)}});
+            SCAN2PDF_PROBE(classify_end, record.frame, record.reduction->c_str());
+
+            // attempt to orient using tesseract.
+            const auto ori_deg{page->orientation()};
+            if (!back_side) {
+                front_orientation = ori_deg;
+            }
+            record.has_text = page->has_text();
+            record.orientation = ori_deg;
+
+            // a jpeg page can only stay as it is if it is upright
+            if (jpeg_frame && (ori_deg == 0)) {
+                logger("Passing the jpeg frame through\n");
+                pass_through_pages.emplace(images.size(), std::move(jpeg_frame->data));
+                record.pass_through = true;
+            }
+            else if (jpeg_frame) {
+                image = std::move(*full_image);
+            }
+
+            logger(hyx::logger_literals::debug, "Rotating by {} degrees\n", ori_deg);
+            image.rotate(360 - ori_deg);
+
+            document_text += page->text();
+            page_texts.push_back(page->text());
+            finish_ocr(record, ocr_time);
+
+            logger("Adding to list of images\n");
+            images.emplace_back(std::move(image));
+            output_resolutions.push_back(output_resolution);
+        }};
+
+        // everything after proccess() is the same for whole frames and for items split out of them
+        const auto digest_page{[&](Magick::Image& image, bool back_side, std::optional<raw_frame> jpeg_frame) {
+            dump_image(image, "proccessed");
+
+            // the page statistics and global thresholds all come from this one histogram
+            auto luma{get_luma(image)};
+            auto histogram{get_luma_histogram(luma)};
+
+            auto& record{manifest.pages.emplace_back(current_page)};
+            if (is_white(get_percent_white(histogram), config)) {
+                logger("Removing image\n");
+                record_decision(record, "white");
+            }
+            else if (const auto hash{get_page_hash(luma)}; is_duplicate_page(hash, recent_page_hashes) && drop_duplicates) {
+                logger("Removing duplicate image\n");
+                record_decision(record, "duplicate");
+            }
+            else {
+                logger("Keeping image\n");
+                record_decision(record, "kept");
+                kept_records.push_back(manifest.pages.size() - 1);
+                document_page_hashes.push_back(hash);
+
+                // while the pages so far look like a known document, its OCR may never be needed
+                std::erase_if(known_candidates, [&hash, page = document_page_hashes.size() - 1](const auto* known) {
+                    return (known->page_hashes.size() <= page) || ((known->page_hashes[page] ^ hash).count() > global::duplicate_page_distance);
+                });
+                if (!known_candidates.empty()) {
+                    logger(hyx::logger_literals::debug, "Pages so far match {} known documents: deferring OCR\n", known_candidates.size());
+                    deferred_pages.push_back({std::move(image), std::move(luma), histogram, back_side, std::move(jpeg_frame)});
+                    return;
+                }
+
+                for (auto& deferred : deferred_pages) {
+                    finish_page(deferred.image, deferred.luma, deferred.histogram, deferred.back_side, std::move(deferred.jpeg_frame));
+                }
+                deferred_pages.clear();
+
+                finish_page(image, luma, histogram, back_side, std::move(jpeg_frame));
+            }
+        }};
+
+        // text only needs an upright bilevel proxy that is good enough for OCR
+        const auto read_text_page{[&](Magick::Image& image, bool back_side) {
+            // a barcode on the first page can name the document without any text parsing (and needs the full resolution)
+            if (auto_mode && page_texts.empty()) {
+                barcode_fields = get_barcode_fields(get_luma(image));
+            }
+
+            if (image.density().x() > global::text_resolution) {
+                image.resample(Magick::Point(global::text_resolution));
+            }
+
+            const auto luma{get_luma(image)};
+            const auto histogram{get_luma_histogram(luma)};
+            auto& record{manifest.pages.emplace_back(current_page)};
+            if (is_white(get_percent_white(gamma_luma_histogram(histogram, global::scanner_gamma_fix)), config)) {
+                logger("Removing image\n");
+                record_decision(record, "white");
+                return;
+            }
+            record_decision(record, "kept");
+
+            SCAN2PDF_PROBE(ocr_start, record.frame, image.columns(), image.rows());
+            const auto ocr_start{std::chrono::high_resolution_clock::now()};
+            ocr_page page(tess_api.get(), bilevel2pix(adaptive_threshold(luma, threshold_method::sauvola, histogram), static_cast<int>(image.density().x())), get_orientation_prior(back_side));
+            const auto ori_deg{page.orientation()};
+            if (!back_side) {
+                front_orientation = ori_deg;
+            }
+            record.has_text = page.has_text();
+            record.orientation = ori_deg;
+
+            document_text += page.text();
+            page_texts.push_back(page.text());
+            SCAN2PDF_PROBE(ocr_end, record.frame, page_texts.back().size());
+            finish_ocr(record, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - ocr_start));
+        }};
+
+        // the scanning thread keeps its own totals; they are only read after it joins
+        std::chrono::milliseconds acquire_time{};
+        std::uintmax_t scanned_bytes{};
+        std::exception_ptr scan_error;
 
         { // jthread start
             // we only share the images container and atomic boolean—which gets set as the last thing the thread does—so it should be thread safe
-            std::jthread t1([&images_buffer, &device, &done_scanning]() {
-                for (auto i{0}; device->start(); ++i) {
-                    logger("Obtaining image {}\n", i);
-                    images_buffer.emplace(get_next_image(device));
+            std::jthread t1([&images_buffer, &device, &done_scanning, &reprocess_archive, &raw_archive, &acquire_time, &scanned_bytes, &emit_event, &scan_error]() {
+                const auto emit_acquired{[&emit_event](std::size_t i, const raw_frame& frame) {
+                    emit_event("page_acquired", {{"frame", std::to_string(i)}, {"width", std::to_string(frame.params.pixels_per_line)}, {"height", std::to_string(frame.params.lines)}, {"bytes", std::to_string(frame.data.size())}});
+                }};
+
+                // an exception must not escape the thread (that would terminate us), so main gets it after the join
+                try {
+                    if (reprocess_archive) {
+                        for (std::size_t i{0}; i < reprocess_archive->size(); ++i) {
+                            logger("Reading image {} from archive\n", i);
+                            SCAN2PDF_PROBE(acquire_start, i);
+                            const auto acquire_start{std::chrono::high_resolution_clock::now()};
+                            auto frame{reprocess_archive->frame(i)};
+                            acquire_time += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - acquire_start);
+                            SCAN2PDF_PROBE(acquire_end, i, frame.params.pixels_per_line, frame.params.lines, frame.data.size());
+                            scanned_bytes += frame.data.size();
+                            emit_acquired(i, frame);
+                            images_buffer.emplace(get_scanned_image(std::move(frame)));
+                        }
+                    }
+                    else {
+                        const auto resolution{std::any_cast<SANE_Word>(sane_options.at(SANE_NAME_SCAN_RESOLUTION))};
+                        for (auto i{0}; device->start(); ++i) {
+                            logger("Obtaining image {}\n", i);
+                            SCAN2PDF_PROBE(acquire_start, i);
+                            const auto acquire_start{std::chrono::high_resolution_clock::now()};
+                            auto frame{get_next_frame(device, resolution)};
+                            acquire_time += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - acquire_start);
+                            SCAN2PDF_PROBE(acquire_end, i, frame.params.pixels_per_line, frame.params.lines, frame.data.size());
+                            scanned_bytes += frame.data.size();
+                            emit_acquired(static_cast<std::size_t>(i), frame);
+                            // the archive is only a copy, so the scan goes on without it
+                            if (raw_archive) {
+                                try {
+                                    raw_archive->append(frame);
+                                }
+                                catch (const std::exception& e) {
+                                    logger(hyx::logger_literals::warning, "Failed to archive frame {} (no longer archiving): {}\n", i, e.what());
+                                    raw_archive.reset();
+                                }
+                            }
+                            images_buffer.emplace(get_scanned_image(std::move(frame)));
+                        }
+                    }
+                }
+                catch (...) {
+                    scan_error = std::current_exception();
                 }
 
                 // ok, we are done and images is not empty (unless nothing was scanned)
@@ -662,58 +3906,153 @@ int main(int argc, char** argv)
                     std::this_thread::sleep_for(100ms);
                 }
                 else {
+                    if (reload_config_requested.exchange(false)) {
+                        check_config();
+                    }
+
                     // take and process an image
-                    Magick::Image image{images_buffer.take()};
+                    auto scanned{images_buffer.take()};
+                    auto& image{scanned.image};
+                    SCAN2PDF_PROBE(page_start, img_num, image.columns(), image.rows());
 
                     // static const auto log_prefix{"Image " + std::to_string(img_num)};
                     dump_image(image, "initial");
 
                     logger("Digesting image\n");
 
-                    // set image settings
-                    image.compressType(Magick::LZWCompression);
-                    image.density(std::any_cast<SANE_Word>(sane_options.at(SANE_NAME_SCAN_RESOLUTION)));
+                    // the proxy of a jpeg frame only stands in for the page if the page can go into the pdf as it is
+                    if (scanned.jpeg_frame && !text_only && (split_mode || !is_pass_through_jpeg(image, config))) {
+                        image = frame_to_image(*scanned.jpeg_frame);
+                        scanned.jpeg_frame.reset();
+                    }
 
-                    proccess(image);
+                    // set image settings (the density comes with the frame)
+                    image.compressType(Magick::LZWCompression);
 
-                    dump_image(image, "proccessed");
+                    const auto back_side{duplex && (img_num % 2) == 1};
+                    current_page = {.frame = static_cast<std::size_t>(img_num)};
+                    if (text_only) {
+                        read_text_page(image, back_side);
+                    }
+                    else if (split_mode) {
+                        // every item on the bed becomes its own page
+                        const auto proccess_start{std::chrono::high_resolution_clock::now()};
+                        auto items{split_items(image)};
+                        proccess_items(items);
+                        add_stage_time("proccess", proccess_start);
+                        for (auto& item : items) {
+                            digest_page(item, false, std::nullopt);
+                        }
+                    }
+                    else if (scanned.jpeg_frame) {
+                        // nothing to straighten or crop, so the back side has no front geometry to reuse
+                        if (!back_side) {
+                            front_geometry.reset();
+                            front_orientation.reset();
+                        }
 
-                    if (is_white(image)) {
-                        logger("Removing image\n");
+                        digest_page(image, back_side, std::move(scanned.jpeg_frame));
+                    }
+                    else if (back_side && front_geometry && is_blank_back_side(image, *front_geometry, config)) {
+                        logger("Removing blank back image\n");
+                        record_decision(manifest.pages.emplace_back(page_record{.frame = current_page.frame}), "blank_back");
                     }
                     else {
-                        logger("Keeping image\n");
-
-                        if (is_bw(image)) {
-                            has_text(tess_api.get(), hyx::unique_pix(magick2pix(image)).get()) ? transform_with_text_to_bw(image) : transform_to_bw(image);
-                        }
-                        else if (is_grayscale(image)) {
-                            transform_to_grayscale(image);
+                        const auto proccess_start{std::chrono::high_resolution_clock::now()};
+                        const auto geometry{proccess(image, back_side ? front_geometry : std::nullopt)};
+                        add_stage_time("proccess", proccess_start);
+                        if (!back_side) {
+                            front_geometry = geometry;
+                            front_orientation.reset();
                         }
-                        // else, image is color
+                        current_page.deskew_angle = geometry.deskew_angle;
+                        current_page.crop = geometry.trim_edges;
 
-                        dump_image(image, "reduced");
+                        digest_page(image, back_side, std::nullopt);
+                    }
 
-                        hyx::unique_pix pimage{magick2pix(image)};
+                    SCAN2PDF_PROBE(page_end, img_num);
+                    ++img_num;
+                }
+            }
+        } // jthread join
+        if (scan_error) {
+            std::rethrow_exception(scan_error);
+        }
+        manifest.stage_times["acquire"] += acquire_time;
+        manifest.byte_counts["scanned"] = scanned_bytes;
+
+        if (!deferred_pages.empty()) {
+            // the text check only needs a quick read of the first page, at the resolution text-only jobs use
+            Magick::Image proxy{deferred_pages.front().image};
+            if (proxy.density().x() > global::text_resolution) {
+                proxy.resample(Magick::Point(global::text_resolution));
+            }
+            const auto proxy_luma{get_luma(proxy)};
+            ocr_page proxy_page(tess_api.get(), bilevel2pix(adaptive_threshold(proxy_luma, threshold_method::sauvola, get_luma_histogram(proxy_luma)), static_cast<int>(proxy.density().x())));
+
+            if (const auto* known{find_known_document(known_candidates, {.page_hashes = document_page_hashes, .text_signature = get_text_signature(proxy_page.text())})}) {
+                handle_known_document(*known);
+                manifest.document = known->document.string();
+                save_manifest("known");
+                return 0;
+            }
 
-                        // attempt to orient using tesseract.
-                        auto ori_deg{get_orientation(tess_api.get(), pimage.get())};
+            // the pages were only the start of a longer known document, or one on the same template
+            for (auto& deferred : deferred_pages) {
+                finish_page(deferred.image, deferred.luma, deferred.histogram, deferred.back_side, std::move(deferred.jpeg_frame));
+            }
+            deferred_pages.clear();
+        }
 
-                        logger(hyx::logger_literals::debug, "Rotating by {} degrees\n", ori_deg);
-                        image.rotate(360 - ori_deg);
+        const document_fingerprint fingerprint{.page_hashes = document_page_hashes, .text_signature = get_text_signature(page_texts.empty() ? std::string() : page_texts.front())};
 
-                        logger("Collecting text\n");
-                        pimage.reset(pixRotateOrth(pimage.get(), ori_deg / 90));
-                        document_text += get_text(tess_api.get(), pimage.get());
+        std::optional<document_fields> fields;
+        if (auto_mode && (!document_text.empty() || barcode_fields)) {
+            // barcode fields win over (and skip) parsing the text
+            fields = barcode_fields.value_or(document_fields{});
+            const auto barcode{*fields};
+            if (!fields->organization) {
+                fields->organization = parse_organization(document_text, "<org>");
+            }
+            fields->date = hyx::parser::parse_date(fields->date ? *fields->date : document_text, get_current_date());
+            if (!fields->store) {
+                fields->store = hyx::parser::parse_store(document_text, "<store>");
+            }
+            if (!fields->transaction) {
+                fields->transaction = hyx::parser::parse_transaction(document_text, "<transaction>");
+            }
 
-                        logger("Adding to list of images\n");
-                        images.emplace_back(std::move(image));
-                    }
+            filename = std::regex_replace(filename, std::regex("%o"), *fields->organization);
+            filename = std::regex_replace(filename, std::regex("%d"), *fields->date);
+            filename = std::regex_replace(filename, std::regex("%s"), *fields->store);
+            filename = std::regex_replace(filename, std::regex("%t"), *fields->transaction);
+
+            // a field that is not from a barcode either came from the text or is the placeholder it falls back to
+            const auto source{[](const std::optional<std::string>& barcode_value, const std::string& value, std::string_view fallback) -> std::string_view {
+                return barcode_value ? "barcode" : ((value == fallback) ? "default" : "text");
+            }};
+            manifest.fields = {
+                {"organization", *fields->organization, source(barcode.organization, *fields->organization, "<org>")},
+                {"date", *fields->date, source(barcode.date, *fields->date, get_current_date())},
+                {"store", *fields->store, source(barcode.store, *fields->store, "<store>")},
+                {"transaction", *fields->transaction, source(barcode.transaction, *fields->transaction, "<transaction>")},
+            };
+        }
+        logger(hyx::logger_literals::debug, "File name is \'{}\'\n", filename);
 
-                    ++img_num;
-                }
+        if (text_only) {
+            if (page_texts.empty()) {
+                throw std::runtime_error("Too few images to output text.");
             }
-        } // jthread join
+
+            write_text_output(outpath / filename, page_texts, fields);
+            manifest.document = (outpath / filename).string();
+            emit_event("document_written", {{"path", to_json_string(manifest.document)}});
+            save_manifest("complete");
+            logger("Text ready!\n");
+            return 0;
+        }
 
         if (images.size() == 0) {
             throw std::runtime_error("Too few images to output a pdf.");
@@ -722,32 +4061,144 @@ int main(int argc, char** argv)
         std::string combined_pages_filepath{(tmppath / "combined_pages")};
 
         logger("Starting to process pdf\n");
-        Magick::writeImages(images.begin(), images.end(), combined_pages_filepath + ".tiff");
-
-        if (auto_mode && !document_text.empty()) {
-            filename = std::regex_replace(filename, std::regex("%o"), parse_organization(document_text, "<org>"));
-            filename = std::regex_replace(filename, std::regex("%d"), hyx::parser::parse_date(document_text, get_current_date()));
-            filename = std::regex_replace(filename, std::regex("%s"), hyx::parser::parse_store(document_text, "<store>"));
-            filename = std::regex_replace(filename, std::regex("%t"), hyx::parser::parse_transaction(document_text, "<transaction>"));
+        // every page gets a file of its own, encoded in memory and written while the next one is encoded (tesseract only
+        // embeds jpeg files without re-encoding them, so this is also how passed through and downsampled pages get in)
+        const auto downsample_page{[&](std::size_t idx) { return (output_resolutions[idx] > 0) && (output_resolutions[idx] < images[idx].density().y()); }};
+        std::vector<std::string> page_filepaths;
+        SCAN2PDF_PROBE(encode_start, images.size());
+        const auto encode_start{std::chrono::high_resolution_clock::now()};
+        async_writer writer;
+        const auto write_page{[&writer, &page_filepaths](std::string page_filepath, Magick::Image& page, std::string_view format) {
+            Magick::Blob blob;
+            page.write(&blob, std::string(format));
+            const auto* const data{static_cast<const std::uint8_t*>(blob.data())};
+            writer.write(page_filepaths.emplace_back(std::move(page_filepath)), std::vector<std::uint8_t>(data, data + blob.length()));
+        }};
+
+        for (std::size_t idx{}; idx < images.size(); ++idx) {
+            if (const auto jpeg{pass_through_pages.find(idx)}; jpeg != pass_through_pages.end()) {
+                writer.write(page_filepaths.emplace_back(std::format("{}_{}.jpg", combined_pages_filepath, idx)), jpeg->second);
+            }
+            else if (downsample_page(idx)) {
+                logger(hyx::logger_literals::debug, "Downsampling image {} to {}dpi\n", idx, output_resolutions[idx]);
+                Magick::Image output{images[idx]};
+                output.filterType(Magick::LanczosFilter);
+                output.resample(Magick::Point(output_resolutions[idx]));
+                output.quality(global::output_jpeg_quality);
+                write_page(std::format("{}_{}.jpg", combined_pages_filepath, idx), output, "JPEG");
+            }
+            else {
+                write_page(std::format("{}_{}.tiff", combined_pages_filepath, idx), images[idx], "TIFF");
+            }
+            writer.submit();
         }
-        logger(hyx::logger_literals::debug, "File name is \'{}\'\n", filename);
 
-        if (!tess_api->ProcessPages((combined_pages_filepath + ".tiff").c_str(), nullptr, static_cast<int>(10'000 * images_buffer.size()), std::make_unique<tesseract::TessPDFRenderer>(combined_pages_filepath.c_str(), tess_api->GetDatapath(), false).get())) {
+        // tesseract reads the page files back
+        writer.wait();
+
+        add_stage_time("encode", encode_start);
+        SCAN2PDF_PROBE(encode_end, images.size());
+        emit_event("encode_done", {{"pages", std::to_string(images.size())}, {"ms", std::to_string(manifest.stage_times["encode"].count())}});
+
+        auto ocr_done{false};
+        SCAN2PDF_PROBE(render_start, images.size());
+        const auto render_start{std::chrono::high_resolution_clock::now()};
+        { // renderer start
+            const auto ocr_timeout{static_cast<int>(10'000 * images_buffer.size())};
+            const auto renderer{std::make_unique<tesseract::TessPDFRenderer>(combined_pages_filepath.c_str(), tess_api->GetDatapath(), false)};
+
+            // the text layer still comes from the full resolution image, whatever resolution the page goes into the pdf with
+            ocr_done = renderer->BeginDocument(filename.c_str());
+            for (std::size_t idx{}; ocr_done && (idx < images.size()); ++idx) {
+                const auto jpeg{pass_through_pages.find(idx)};
+                const hyx::unique_pix pimage{(jpeg != pass_through_pages.end()) ? pixReadMem(jpeg->second.data(), jpeg->second.size()) : magick2pix(images[idx])};
+                ocr_done = tess_api->ProcessPage(pimage.get(), static_cast<int>(idx), page_filepaths[idx].c_str(), nullptr, ocr_timeout, renderer.get());
+            }
+            ocr_done = renderer->EndDocument() && ocr_done;
+        } // renderer end (closes the pdf)
+
+        if (!ocr_done) {
             logger(hyx::logger_literals::warning, "OCR taking too long: skipping\n");
+            for (const auto& [idx, jpeg] : pass_through_pages) {
+                images[idx].read(Magick::Blob(jpeg.data(), jpeg.size()));
+            }
             Magick::writeImages(images.begin(), images.end(), (combined_pages_filepath + ".pdf"));
         }
+        add_stage_time("render", render_start);
+        SCAN2PDF_PROBE(render_end, images.size());
+
+        // the output path may be a slow network share, so the document gets indexed while it is written there; it is
+        // written under a temporary name so a failed write never leaves a truncated document behind
+        const auto output_filepath{outpath / (filename + ".pdf")};
+        const auto partial_filepath{outpath / ("." + filename + ".pdf.partial")};
+        try {
+            const auto pdf_size{std::filesystem::file_size(combined_pages_filepath + ".pdf")};
+            std::ifstream pdf(combined_pages_filepath + ".pdf", std::ios::binary);
+            const auto fd{writer.open(partial_filepath)};
+            for (std::uint64_t offset{}; offset < pdf_size; offset += global::output_copy_chunk) {
+                std::vector<std::uint8_t> chunk(std::min<std::uint64_t>(global::output_copy_chunk, pdf_size - offset));
+                if (!pdf.read(reinterpret_cast<char*>(chunk.data()), static_cast<std::streamsize>(chunk.size()))) {
+                    throw std::runtime_error("Failed to read output file: \'" + combined_pages_filepath + ".pdf\'");
+                }
+                writer.write(fd, std::move(chunk), offset);
+                writer.submit();
+            }
+            manifest.byte_counts["pdf"] = pdf_size;
+        }
+        catch (const std::exception&) {
+            std::error_code ecode;
+            std::filesystem::remove(partial_filepath, ecode);
+            throw;
+        }
+
+        // none of this needs the written document, so it is prepared while the write is still going
+        std::optional<index_segment> segment;
+        try {
+            segment = get_index_segment(output_filepath, page_texts);
+        }
+        catch (const std::exception& e) {
+            logger(hyx::logger_literals::warning, "Failed to index document: {}\n", e.what());
+        }
+        const document_fingerprint fingerprint_record{.page_hashes = fingerprint.page_hashes, .text_signature = fingerprint.text_signature, .document = output_filepath};
+        manifest.document = output_filepath.string();
 
-        std::error_code ecode;
-        if (!std::filesystem::copy_file(combined_pages_filepath + ".pdf", outpath / (filename + ".pdf"), std::filesystem::copy_options::update_existing, ecode)) {
-            throw std::runtime_error("Failed to move output file: \'" + ecode.message() + "\'");
+        try {
+            writer.wait();
+            std::filesystem::rename(partial_filepath, output_filepath);
+        }
+        catch (const std::exception& e) {
+            std::error_code ecode;
+            std::filesystem::remove(partial_filepath, ecode);
+            throw std::runtime_error("Failed to move output file: \'" + std::string(e.what()) + "\'");
         }
         logger(hyx::logger_literals::debug, "Moved file successfully\n");
+        emit_event("document_written", {{"path", to_json_string(manifest.document)}, {"bytes", std::to_string(manifest.byte_counts["pdf"])}});
+
+        // the document is already written, so a broken index or fingerprint store should not fail it
+        try {
+            if (segment) {
+                add_to_index(index_path, *segment);
+            }
+        }
+        catch (const std::exception& e) {
+            logger(hyx::logger_literals::warning, "Failed to index document: {}\n", e.what());
+        }
+
+        try {
+            save_fingerprint(outpath / global::fingerprint_store, fingerprint_record);
+        }
+        catch (const std::exception& e) {
+            logger(hyx::logger_literals::warning, "Failed to save document fingerprint: {}\n", e.what());
+        }
 
+        save_manifest("complete");
         logger("Document ready!\n");
     }
     catch (const std::exception& e) {
         std::cout << e.what() << "\n";
         logger(hyx::logger_literals::fatal, "{}\n", e.what());
+        manifest.error = e.what();
+        save_manifest("failed");
         return 1;
     }
     // catch (const Magick::Error& me) {